@@ -8,17 +8,144 @@
 #include <vector>        // handles resizable array containers
 #include <algorithm>
 #include <string>
-#include <sstream>
 #include <cmath>        // for math functions
 #include <pthread.h>
+#include <deque>
+#include <atomic>
+#include <cstdlib>
+#include <unistd.h>
+#include <cstdint>
+#include <queue>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef SHANNON_STATS
+#include <chrono>
+#include <csignal>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h> // AVX2 / AVX-512 encode kernels, compiled per function and picked at run time
+#endif
 
 using namespace std;
 
+#ifdef SHANNON_STATS
+// Instrumentation, only compiled in with -DSHANNON_STATS (the macros below expand
+// to nothing otherwise). Every thread claims a counter slot once and then only
+// touches its own slot, so recording never takes a lock.
+enum Stage { STAGE_HISTOGRAM, STAGE_SORT, STAGE_CODES, STAGE_ENCODE, STAGE_DECODE, STAGE_OUTPUT, STAGE_COUNT };
+static const char* stage_names[STAGE_COUNT] = { "histogram", "sort", "codes", "encode", "decode", "output" };
+
+const int STATS_SLOTS = 64; // Threads past this share slots round-robin (still lock-free)
+
+struct alignas(64) StatsSlot
+{
+    atomic<uint64_t> stage_ns[STAGE_COUNT];
+    atomic<uint64_t> stage_calls[STAGE_COUNT];
+    atomic<uint64_t> messages;
+    atomic<uint64_t> bytes_in;
+    atomic<uint64_t> bits_out;
+    atomic<uint64_t> tasks;
+    atomic<uint64_t> steals;
+};
+
+static StatsSlot stats_slots[STATS_SLOTS];
+static atomic<unsigned> stats_next_slot(0);
+static thread_local StatsSlot* stats_slot = nullptr;
+static thread_local chrono::steady_clock::time_point stats_lap_start;
+
+static StatsSlot& stats_local()
+{
+    if (stats_slot == nullptr)
+    {
+        stats_slot = &stats_slots[stats_next_slot.fetch_add(1, memory_order_relaxed) % STATS_SLOTS];
+    }
+    return *stats_slot;
+}
+
+// Charges the time since the previous lap (or STATS_START) to the given stage
+static void stats_lap(Stage stage)
+{
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    StatsSlot& slot = stats_local();
+    slot.stage_ns[stage].fetch_add(chrono::duration_cast<chrono::nanoseconds>(now - stats_lap_start).count(), memory_order_relaxed);
+    slot.stage_calls[stage].fetch_add(1, memory_order_relaxed);
+    stats_lap_start = now;
+}
+
+// Sums every slot and prints the totals to stderr
+static void stats_dump()
+{
+    uint64_t ns[STAGE_COUNT] = {0}, calls[STAGE_COUNT] = {0}, messages = 0, bytes_in = 0, bits_out = 0, tasks = 0, steals = 0;
+    for (int i = 0; i < STATS_SLOTS; ++i)
+    {
+        for (int s = 0; s < STAGE_COUNT; ++s)
+        {
+            ns[s] += stats_slots[i].stage_ns[s].load(memory_order_relaxed);
+            calls[s] += stats_slots[i].stage_calls[s].load(memory_order_relaxed);
+        }
+        messages += stats_slots[i].messages.load(memory_order_relaxed);
+        bytes_in += stats_slots[i].bytes_in.load(memory_order_relaxed);
+        bits_out += stats_slots[i].bits_out.load(memory_order_relaxed);
+        tasks += stats_slots[i].tasks.load(memory_order_relaxed);
+        steals += stats_slots[i].steals.load(memory_order_relaxed);
+    }
+    fprintf(stderr, "[stats] messages: %llu, bytes in: %llu, bits out: %llu, tasks: %llu, steals: %llu\n",
+            (unsigned long long)messages, (unsigned long long)bytes_in, (unsigned long long)bits_out,
+            (unsigned long long)tasks, (unsigned long long)steals);
+    for (int s = 0; s < STAGE_COUNT; ++s)
+    {
+        fprintf(stderr, "[stats] %-10s calls: %-8llu total: %.3f ms, avg: %.3f us\n", stage_names[s],
+                (unsigned long long)calls[s], ns[s] / 1e6, calls[s] ? ns[s] / 1e3 / calls[s] : 0.0);
+    }
+}
+
+// Dumps the counters each time SIGUSR1 arrives; SIGUSR1 is blocked in every
+// other thread so the dump runs here instead of inside a signal handler
+static void* stats_signal_thread(void* arg)
+{
+    sigset_t* set = static_cast<sigset_t*>(arg);
+    int sig;
+    while (sigwait(set, &sig) == 0)
+    {
+        stats_dump();
+    }
+    return nullptr;
+}
+
+static void stats_init()
+{
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr); // Inherited by every thread created afterwards
+    pthread_t tid;
+    pthread_create(&tid, nullptr, stats_signal_thread, &set);
+    pthread_detach(tid);
+}
+
+#define STATS_INIT() stats_init()
+#define STATS_DUMP() stats_dump()
+#define STATS_START() (stats_lap_start = chrono::steady_clock::now())
+#define STATS_LAP(stage) stats_lap(stage)
+#define STATS_ADD(counter, n) stats_local().counter.fetch_add((n), memory_order_relaxed)
+#else
+#define STATS_INIT()
+#define STATS_DUMP()
+#define STATS_START()
+#define STATS_LAP(stage)
+#define STATS_ADD(counter, n)
+#endif
+
 // Struct to store the result for each encoded message
 struct EncodedResult 
 {
    string message;
-   map<char, string> shannon_algorithm; // Shannon codes for each character
+   map<char, string> shannon_algorithm; // Codes for each character (Shannon unless -e picks another engine)
    string encoded_string;
    map<char, int> frequency; // The frequency of each character
    vector<pair<char, int>> sorted_symbols; // Always keep symbols in a sorted order
@@ -73,89 +200,1679 @@ void calculateShannonCodes(const vector<pair<char, int>>& symbols, int overall_f
     }
 }
 
-// Main function that performs Shannon coding for a given input string
-void shannon_coding(const string& input, EncodedResult& result) 
+// Gives every symbol a canonical code of its length: shorter codes come first and
+// symbols of the same length keep their sorted order
+void assignCanonicalCodes(const vector<pair<char, int>>& symbols, const vector<int>& lengths, map<char, string>& codes)
 {
-    map<char, int> frequency; // Map to store frequency of each character
+    vector<size_t> order(symbols.size());
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        order[i] = i;
+    }
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return lengths[a] < lengths[b]; });
 
-    // Calculate the frequency of each character in the input string
-    for (char ch : input) 
+    string code = ""; // The next free code, padded with zeros to the current length
+    for (size_t i : order)
     {
-        frequency[ch]++; // Increment frequency count for the character
+        code.append(lengths[i] - code.size(), '0');
+        codes[symbols[i].first] = code;
+
+        // Move on to the following code by adding one to the binary number
+        for (size_t b = code.size(); b-- > 0; )
+        {
+            code[b] = code[b] == '0' ? '1' : '0';
+            if (code[b] == '1')
+            {
+                break;
+            }
+        }
+    }
+}
+
+// Function to calculate Huffman codes: the two least frequent subtrees are merged
+// until one tree is left, and each code length is the depth of its symbol
+void calculateHuffmanCodes(const vector<pair<char, int>>& symbols, int overall_frequency, map<char, string>& codes)
+{
+    (void)overall_frequency;
+    size_t n = symbols.size();
+    if (n == 1)
+    {
+        codes[symbols[0].first] = "0"; // A lone symbol still needs one bit
+        return;
+    }
+
+    // Min-heap of (weight, node); nodes below n are the symbols themselves
+    priority_queue<pair<long long, size_t>, vector<pair<long long, size_t>>, greater<pair<long long, size_t>>> heap;
+    vector<size_t> parent(2 * n, 0);
+    for (size_t i = 0; i < n; ++i)
+    {
+        heap.push(make_pair((long long)symbols[i].second, i));
+    }
+    for (size_t node = n; heap.size() > 1; ++node)
+    {
+        pair<long long, size_t> a = heap.top(); heap.pop();
+        pair<long long, size_t> b = heap.top(); heap.pop();
+        parent[a.second] = parent[b.second] = node;
+        heap.push(make_pair(a.first + b.first, node));
+    }
+
+    // The root is the last node created; count the steps up to it
+    size_t root = 2 * n - 2;
+    vector<int> lengths(n, 0);
+    for (size_t i = 0; i < n; ++i)
+    {
+        for (size_t node = i; node != root; node = parent[node])
+        {
+            lengths[i]++;
+        }
+    }
+    assignCanonicalCodes(symbols, lengths, codes);
+}
+
+// Function to calculate the best codes no longer than max_length bits with the
+// package-merge algorithm. Each round pairs up the cheapest items of the previous
+// round into packages and merges them with the symbols again; a symbol's code
+// length is how often it appears in the 2n - 2 cheapest items of the last round.
+void calculateLengthLimitedCodes(const vector<pair<char, int>>& symbols, int max_length, map<char, string>& codes)
+{
+    size_t n = symbols.size();
+    if (n == 1)
+    {
+        codes[symbols[0].first] = "0"; // A lone symbol still needs one bit
+        return;
+    }
+    while ((1ULL << max_length) < n)
+    {
+        max_length++; // Too few codes of that length for every symbol
+    }
+
+    // Items 0..n-1 are the symbols, cheapest first; packages are added after them
+    struct Item
+    {
+        long long weight;
+        size_t left, right; // Packed items (unused for symbols)
+    };
+    vector<Item> items;
+    for (size_t k = 0; k < n; ++k)
+    {
+        items.push_back(Item{symbols[n - 1 - k].second, 0, 0});
+    }
+    vector<size_t> round(n);
+    for (size_t k = 0; k < n; ++k)
+    {
+        round[k] = k;
+    }
+    for (int level = 1; level < max_length; ++level)
+    {
+        vector<size_t> merged;
+        size_t leaf = 0;
+        for (size_t k = 0; k + 1 < round.size(); k += 2)
+        {
+            items.push_back(Item{items[round[k]].weight + items[round[k + 1]].weight, round[k], round[k + 1]});
+            while (leaf < n && items[leaf].weight <= items.back().weight)
+            {
+                merged.push_back(leaf++);
+            }
+            merged.push_back(items.size() - 1);
+        }
+        while (leaf < n)
+        {
+            merged.push_back(leaf++);
+        }
+        round = merged;
+    }
+
+    // Count how often each symbol is used by the chosen items
+    vector<int> lengths(n, 0);
+    vector<size_t> pending(round.begin(), round.begin() + 2 * n - 2);
+    while (!pending.empty())
+    {
+        size_t item = pending.back();
+        pending.pop_back();
+        if (item < n)
+        {
+            lengths[n - 1 - item]++;
+        }
+        else
+        {
+            pending.push_back(items[item].left);
+            pending.push_back(items[item].right);
+        }
+    }
+    assignCanonicalCodes(symbols, lengths, codes);
+}
+
+// Package-merge limits that keep decoding tables small
+void calculateLimited12Codes(const vector<pair<char, int>>& symbols, int overall_frequency, map<char, string>& codes)
+{
+    (void)overall_frequency;
+    calculateLengthLimitedCodes(symbols, 12, codes);
+}
+
+void calculateLimited15Codes(const vector<pair<char, int>>& symbols, int overall_frequency, map<char, string>& codes)
+{
+    (void)overall_frequency;
+    calculateLengthLimitedCodes(symbols, 15, codes);
+}
+
+// Code constructions that can be chosen with -e. Each one fills in a code for
+// every symbol of a list sorted by frequency (descending) and ASCII value.
+struct CodeEngine
+{
+    const char* name;  // Name given to -e
+    const char* label; // Printed in front of each code in the alphabet
+    void (*build)(const vector<pair<char, int>>& symbols, int overall_frequency, map<char, string>& codes);
+};
+
+static const CodeEngine code_engines[] = {
+    {"shannon", "Shannon code", calculateShannonCodes},
+    {"huffman", "Huffman code", calculateHuffmanCodes},
+    {"limited12", "Length-limited code", calculateLimited12Codes},
+    {"limited15", "Length-limited code", calculateLimited15Codes},
+};
+
+static const CodeEngine* code_engine = &code_engines[0]; // Engine used for every message
+static bool report_efficiency = false;                 // Print bits per symbol and entropy (-r)
+
+// Average code length of a message against the entropy of its symbols
+string efficiency_line(const vector<pair<char, int>>& symbols, const map<char, string>& codes)
+{
+    long long total = 0, bits = 0;
+    for (const auto& symbol : symbols)
+    {
+        total += symbol.second;
+        bits += (long long)symbol.second * codes.at(symbol.first).size();
+    }
+    double entropy = 0.0;
+    for (const auto& symbol : symbols)
+    {
+        double p = (double)symbol.second / total;
+        entropy -= p * log2(p);
+    }
+    char line[96];
+    snprintf(line, sizeof(line), "Bits per symbol: %.3f, entropy: %.3f", (double)bits / total, entropy);
+    return line;
+}
+
+// Looks up an engine by the name given to -e, listing the choices if there is none
+const CodeEngine* find_engine(const char* name)
+{
+    for (const auto& engine : code_engines)
+    {
+        if (strcmp(engine.name, name) == 0)
+        {
+            return &engine;
+        }
     }
+    cerr << "Unknown code engine " << name << ", choose one of:";
+    for (const auto& engine : code_engines)
+    {
+        cerr << " " << engine.name;
+    }
+    cerr << endl;
+    exit(1);
+}
 
+// Sorts the symbols of a finished frequency count and generates their codes
+void build_codes(const map<char, int>& frequency, int overall_frequency, EncodedResult& result)
+{
     // Sort the characters based on frequency (descending) and ASCII value (descending)
     vector<pair<char, int>> sorted_symbols(frequency.begin(), frequency.end()); // Create a vector from the frequency map
     sort(sorted_symbols.begin(), sorted_symbols.end(), custom_comparator); // Sort the symbols using the custom comparator
     result.sorted_symbols = sorted_symbols; // Will store the sorted symbols
+    STATS_LAP(STAGE_SORT);
 
-    // Generate Shannon codes for the sorted symbols
-    int overall_frequency = input.length(); // Total number of characters in the input
-    calculateShannonCodes(sorted_symbols, overall_frequency, result.shannon_algorithm); // Generate codes and store in the result
+    // Generate codes for the sorted symbols with the chosen engine
+    code_engine->build(sorted_symbols, overall_frequency, result.shannon_algorithm); // Generate codes and store in the result
+    result.frequency = frequency; // Store the frequency data for output purposes
+    STATS_LAP(STAGE_CODES);
+}
 
-    // Encode the input message using the generated Shannon codes
-    stringstream encoded_stream; // Use stringstream to build the encoded message
-    for (char ch : input) 
+// Bit-packed encoding. Instead of appending one code string per character, the
+// codes are kept as numbers (first bit in the lowest position), packed into
+// 64-bit words and only then turned into '0'/'1' characters, eight or more at a
+// time. The vector kernels gather the codes of 8 or 16 characters at once, merge
+// neighbouring codes into one value and work out where each value starts with a
+// prefix sum, so the characters no longer wait on each other.
+struct PackedCodes
+{
+    uint32_t code[256];   // Bits of each code, first bit lowest
+    uint32_t length[256]; // Number of bits (32-bit so the vector kernels can gather it)
+    bool fits;            // Every code has at most 32 bits; otherwise the strings are appended as before
+};
+
+const size_t ENCODE_BLOCK = 4096; // Characters packed per round (at most 4096 * 32 bits)
+const size_t ENCODE_WORDS = ENCODE_BLOCK / 2 + 2; // One spare word for put_bits to spill into
+
+void pack_codes(const string codes[256], PackedCodes& packed)
+{
+    packed.fits = true;
+    for (int c = 0; c < 256; ++c)
     {
-        encoded_stream << result.shannon_algorithm[ch]; // Append the Shannon code for each character
+        const string& code = codes[c];
+        packed.code[c] = 0;
+        packed.length[c] = code.size();
+        if (code.size() > 32)
+        {
+            packed.fits = false;
+            continue;
+        }
+        for (size_t b = 0; b < code.size(); ++b)
+        {
+            packed.code[c] |= (uint32_t)(code[b] == '1') << b;
+        }
     }
-    result.encoded_string = encoded_stream.str(); // Store the final encoded message
-    result.message = input; // Store the original input message
-    result.frequency = frequency; // Store the frequency data for output purposes
 }
 
-// Thread function that processes each input string
-void* process_string(void* arg) 
+// ORs bits (at most 64) into the words starting at bit offset
+static inline void put_bits(uint64_t* words, size_t offset, uint64_t bits)
 {
-    EncodedResult* result = static_cast<EncodedResult*>(arg); // Cast the input argument to EncodedResult
-    shannon_coding(result->message, *result); // Perform Shannon coding on the input string
-    pthread_exit(nullptr); 
+    size_t shift = offset & 63;
+    words[offset >> 6] |= bits << shift;
+    if (shift != 0)
+    {
+        words[(offset >> 6) + 1] |= bits >> (64 - shift);
+    }
 }
 
-int main() 
+// Packs the codes of n characters into zeroed words and returns the number of bits
+size_t pack_scalar(const PackedCodes& packed, const unsigned char* input, size_t n, uint64_t* words)
 {
-    vector<string> inputs; // Vector to store multiple input strings
-    string line; // Temporary variable to hold each input line
-    vector<EncodedResult> results; // Vector to store results for each thread
+    size_t bits = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        put_bits(words, bits, packed.code[input[i]]);
+        bits += packed.length[input[i]];
+    }
+    return bits;
+}
 
-    // Reading input strings from standard input 
-    while (getline(cin, line)) 
-    { // Read each line of input
-        if (!line.empty()) { 
-            EncodedResult result;
-            result.message = line; // Store the input message
-            results.push_back(result); // Store the result
+// Writes one character per packed bit, from bit `from` up to `bits`
+void expand_scalar(const uint64_t* words, size_t from, size_t bits, char* output)
+{
+    for (size_t b = from; b < bits; ++b)
+    {
+        output[b] = '0' + ((words[b >> 6] >> (b & 63)) & 1);
+    }
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("avx2")))
+size_t pack_avx2(const PackedCodes& packed, const unsigned char* input, size_t n, uint64_t* words)
+{
+    const __m256i low = _mm256_set1_epi64x(0xffffffff);
+    const __m256i zero = _mm256_setzero_si256();
+    alignas(32) uint64_t pairs[4], starts[4];
+    size_t bits = 0, i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(input + i)));
+        __m256i code = _mm256_i32gather_epi32((const int*)packed.code, index, 4);
+        __m256i length = _mm256_i32gather_epi32((const int*)packed.length, index, 4);
+
+        // Merge each pair of neighbours: the second code goes right after the first
+        __m256i first_length = _mm256_and_si256(length, low);
+        __m256i pair = _mm256_or_si256(_mm256_and_si256(code, low), _mm256_sllv_epi64(_mm256_srli_epi64(code, 32), first_length));
+        __m256i pair_length = _mm256_add_epi64(first_length, _mm256_srli_epi64(length, 32));
+
+        // Inclusive prefix sum of the four pair lengths gives where each pair ends
+        __m256i end = pair_length;
+        end = _mm256_add_epi64(end, _mm256_blend_epi32(_mm256_permute4x64_epi64(end, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x03));
+        end = _mm256_add_epi64(end, _mm256_blend_epi32(_mm256_permute4x64_epi64(end, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x0F));
+        __m256i start = _mm256_add_epi64(_mm256_sub_epi64(end, pair_length), _mm256_set1_epi64x(bits));
+
+        _mm256_store_si256((__m256i*)pairs, pair);
+        _mm256_store_si256((__m256i*)starts, start);
+        for (int k = 0; k < 4; ++k)
+        {
+            put_bits(words, starts[k], pairs[k]);
         }
+        bits += _mm256_extract_epi64(end, 3);
+    }
+    for (; i < n; ++i)
+    {
+        put_bits(words, bits, packed.code[input[i]]);
+        bits += packed.length[input[i]];
     }
+    return bits;
+}
 
-    // Create and launch threads using POSIX threads (pthreads)
-    vector<pthread_t> threads(results.size()); // Create a vector to store thread identifiers
-    for (size_t i = 0; i < results.size(); ++i) 
+__attribute__((target("avx2")))
+void expand_avx2(const uint64_t* words, size_t bits, char* output)
+{
+    // Byte k of a 32-bit group goes to output bytes 8k..8k+7, one bit each
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i select = _mm256_set1_epi64x(0x8040201008040201LL);
+    const __m256i zeros = _mm256_set1_epi8('0');
+    size_t b = 0;
+    for (; b + 32 <= bits; b += 32)
     {
-        pthread_create(&threads[i], nullptr, process_string, &results[i]); // Create a thread for each input string
+        uint32_t group = words[b / 64] >> (b & 63);
+        __m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32(group), spread);
+        __m256i set = _mm256_cmpeq_epi8(_mm256_and_si256(bytes, select), select);
+        _mm256_storeu_si256((__m256i*)(output + b), _mm256_sub_epi8(zeros, set));
     }
+    expand_scalar(words, b, bits, output);
+}
 
-    // Join the threads 
-    for (size_t i = 0; i < results.size(); ++i) 
+__attribute__((target("avx512f,bmi2")))
+size_t pack_avx512(const PackedCodes& packed, const unsigned char* input, size_t n, uint64_t* words)
+{
+    const __m512i low = _mm512_set1_epi64(0xffffffff);
+    const __m512i zero = _mm512_setzero_si512();
+    alignas(64) uint64_t pairs[8], starts[8], ends[8];
+    size_t bits = 0, i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        // The all-ones masked forms give the same results as the plain intrinsics,
+        // whose undefined passthrough makes GCC 12 warn at -O2 -Wall
+        __m512i index = _mm512_maskz_cvtepu8_epi32((__mmask16)-1, _mm_loadu_si128((const __m128i*)(input + i)));
+        __m512i code = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), (__mmask16)-1, index, (const int*)packed.code, 4);
+        __m512i length = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), (__mmask16)-1, index, (const int*)packed.length, 4);
+
+        // Merge each pair of neighbours: the second code goes right after the first
+        __m512i first_length = _mm512_and_si512(length, low);
+        __m512i pair = _mm512_or_si512(_mm512_and_si512(code, low), _mm512_maskz_sllv_epi64((__mmask8)-1, _mm512_maskz_srli_epi64((__mmask8)-1, code, 32), first_length));
+        __m512i pair_length = _mm512_add_epi64(first_length, _mm512_maskz_srli_epi64((__mmask8)-1, length, 32));
+
+        // Inclusive prefix sum over the eight lanes, shifting in zeros by 1, 2 and 4 lanes
+        __m512i end = pair_length;
+        end = _mm512_add_epi64(end, _mm512_maskz_alignr_epi64((__mmask8)-1, end, zero, 7));
+        end = _mm512_add_epi64(end, _mm512_maskz_alignr_epi64((__mmask8)-1, end, zero, 6));
+        end = _mm512_add_epi64(end, _mm512_maskz_alignr_epi64((__mmask8)-1, end, zero, 4));
+        __m512i start = _mm512_add_epi64(_mm512_sub_epi64(end, pair_length), _mm512_set1_epi64(bits));
+
+        _mm512_store_si512(pairs, pair);
+        _mm512_store_si512(starts, start);
+        _mm512_store_si512(ends, end);
+        for (int k = 0; k < 8; ++k)
+        {
+            put_bits(words, starts[k], pairs[k]);
+        }
+        bits += ends[7];
+    }
+    for (; i < n; ++i)
     {
-        pthread_join(threads[i], nullptr); 
+        put_bits(words, bits, packed.code[input[i]]);
+        bits += packed.length[input[i]];
     }
+    return bits;
+}
 
-    // Output results 
-    for (const auto& result : results) 
+__attribute__((target("avx512f,bmi2")))
+void expand_avx512(const uint64_t* words, size_t bits, char* output)
+{
+    // PDEP spreads eight bits over the lowest bit of eight bytes
+    size_t b = 0;
+    for (; b + 8 <= bits; b += 8)
     {
-        cout << "Message: " << result.message << endl << endl;
-        cout << "Alphabet: " << endl;
-        for (const auto& ch_pair : result.sorted_symbols)
+        uint64_t chars = _pdep_u64((words[b / 64] >> (b & 63)) & 0xff, 0x0101010101010101ULL) | 0x3030303030303030ULL;
+        memcpy(output + b, &chars, 8);
+    }
+    expand_scalar(words, b, bits, output);
+}
+#endif
+
+// The widest kernels this CPU supports, picked once. SHANNON_KERNEL=scalar, avx2
+// or avx512 forces one (if the CPU has it), e.g. to compare their output.
+struct EncodeKernel
+{
+    const char* name;
+    size_t (*pack)(const PackedCodes& packed, const unsigned char* input, size_t n, uint64_t* words);
+    void (*expand)(const uint64_t* words, size_t bits, char* output);
+};
+
+void expand_all_scalar(const uint64_t* words, size_t bits, char* output)
+{
+    expand_scalar(words, 0, bits, output);
+}
+
+const EncodeKernel& encode_kernel()
+{
+    static const EncodeKernel kernel = []()
+    {
+        vector<EncodeKernel> kernels;
+#if defined(__GNUC__) && defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("bmi2"))
         {
-            char ch = ch_pair.first;
-            int freq = ch_pair.second;
-            cout << "Symbol: " << ch 
-                 << ", Frequency: " << freq 
-                 << ", Shannon code: " << result.shannon_algorithm.at(ch) << endl; 
+            kernels.push_back(EncodeKernel{"avx512", pack_avx512, expand_avx512});
+        }
+        if (__builtin_cpu_supports("avx2"))
+        {
+            kernels.push_back(EncodeKernel{"avx2", pack_avx2, expand_avx2});
+        }
+#endif
+        kernels.push_back(EncodeKernel{"scalar", pack_scalar, expand_all_scalar});
+        const char* wanted = getenv("SHANNON_KERNEL");
+        for (const auto& kernel : kernels)
+        {
+            if (wanted != nullptr && strcmp(kernel.name, wanted) == 0)
+            {
+                return kernel;
+            }
+        }
+        return kernels.front();
+    }();
+    return kernel;
+}
+
+// Appends the codes of n characters to output
+void encode_symbols(const string codes[256], const PackedCodes& packed, const char* input, size_t n, string& output)
+{
+    if (!packed.fits)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            output += codes[(unsigned char)input[i]];
+        }
+        return;
+    }
+    const EncodeKernel& kernel = encode_kernel();
+    static thread_local vector<uint64_t> words(ENCODE_WORDS);
+    for (size_t done = 0; done < n; done += ENCODE_BLOCK)
+    {
+        size_t count = min(ENCODE_BLOCK, n - done);
+        fill(words.begin(), words.begin() + count / 2 + 2, 0);
+        size_t bits = kernel.pack(packed, (const unsigned char*)input + done, count, words.data());
+        size_t old_size = output.size();
+        output.resize(old_size + bits);
+        kernel.expand(words.data(), bits, &output[old_size]);
+    }
+}
+
+// Main function that performs Shannon coding for a given input string
+void shannon_coding(const string& input, EncodedResult& result) 
+{
+    STATS_START();
+    map<char, int> frequency; // Map to store frequency of each character
+
+    // Calculate the frequency of each character in the input string
+    for (char ch : input) 
+    {
+        frequency[ch]++; // Increment frequency count for the character
+    }
+    STATS_LAP(STAGE_HISTOGRAM);
+
+    // Generate Shannon codes for the sorted symbols
+    build_codes(frequency, input.length(), result);
+
+    // Encode the input message using the generated codes
+    string codes[256]; // Code of each byte value
+    for (const auto& code : result.shannon_algorithm)
+    {
+        codes[(unsigned char)code.first] = code.second;
+    }
+    PackedCodes packed;
+    pack_codes(codes, packed);
+    result.encoded_string.clear();
+    encode_symbols(codes, packed, input.data(), input.size(), result.encoded_string); // Store the final encoded message
+    result.message = input; // Store the original input message
+    STATS_LAP(STAGE_ENCODE);
+    STATS_ADD(bytes_in, input.size());
+    STATS_ADD(bits_out, result.encoded_string.size());
+}
+
+// Seekable container. The input is cut into blocks that are coded on their
+// own, so they can be packed and unpacked in parallel and a byte range can be
+// read back by decoding only the blocks that hold it. Layout (integers are
+// little-endian):
+//   header  "SHNC", u32 version, u32 block size, u32 engine, u64 input size
+//   tables  the shared table, if the blocks use one (256 code lengths)
+//   blocks  each block's own table (unless it uses the shared one), then its
+//           code bits, first bit lowest, padded to a whole byte
+//   index   per block: u64 input offset, u64 bit offset of its code bits,
+//           u64 bit count, u64 table offset, u32 input size, u32 CRC-32 of
+//           its input bytes
+//   footer  u64 index offset, u32 block count, u32 CRC-32 of the index, "SHNI"
+// Only code lengths are stored; both sides derive canonical codes from them.
+const uint32_t CONTAINER_VERSION = 1;
+const size_t CONTAINER_HEADER_SIZE = 24;
+const size_t CONTAINER_ENTRY_SIZE = 40;
+const size_t CONTAINER_FOOTER_SIZE = 20;
+const size_t CONTAINER_MAX_BLOCK = 16 << 20; // Keeps every count of a block within an int
+const int MAX_CODE_BITS = 57;                 // Longest code a 64-bit window can always hold
+const int DECODE_TABLE_BITS = 12;             // Codes up to this long are decoded with one lookup
+
+struct ContainerBlock
+{
+    uint64_t input_offset;
+    uint32_t input_size;
+    uint64_t bit_offset;    // From the start of the file (always a whole byte)
+    uint64_t bit_count;
+    uint64_t table_offset;  // Either the block's own table or the shared one
+    uint32_t crc;           // Of the input bytes
+    uint8_t lengths[256];   // Code length of each byte value, 0 if absent
+    vector<uint8_t> bits;   // Packed code bits (pack only)
+    string error;           // Why the block could not be unpacked, if it could not
+};
+
+struct ContainerJob
+{
+    vector<ContainerBlock> blocks;
+    const unsigned char* input; // pack: the whole input
+    bool shared;                // pack: every block uses shared_lengths
+    uint8_t shared_lengths[256];
+    int fd;                     // unpack: the container file
+    char* output;               // unpack: receives the blocks' bytes
+    uint64_t output_offset;     // unpack: input offset of output[0]
+};
+
+void container_error(const string& message)
+{
+    cerr << message << endl;
+    exit(1);
+}
+
+void put_le(string& out, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; ++i)
+    {
+        out += (char)(value >> (8 * i));
+    }
+}
+
+uint64_t get_le(const unsigned char* in, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i)
+    {
+        value |= (uint64_t)in[i] << (8 * i);
+    }
+    return value;
+}
+
+// CRC-32 (the zlib polynomial), eight bytes per step: table k gives the CRC of a
+// byte followed by k zero bytes, so the eight lookups are independent
+uint32_t crc32(const unsigned char* data, size_t n)
+{
+    static const vector<uint32_t> table = []()
+    {
+        vector<uint32_t> t(8 * 256);
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+            {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        for (int k = 1; k < 8; ++k)
+        {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                t[k * 256 + i] = t[t[(k - 1) * 256 + i] & 0xFF] ^ (t[(k - 1) * 256 + i] >> 8);
+            }
+        }
+        return t;
+    }();
+    const uint32_t* t = table.data();
+    uint32_t crc = 0xFFFFFFFFu;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint32_t low = crc ^ (uint32_t)get_le(data + i, 4);
+        uint32_t high = (uint32_t)get_le(data + i + 4, 4);
+        crc = t[7 * 256 + (low & 0xFF)] ^ t[6 * 256 + ((low >> 8) & 0xFF)] ^ t[5 * 256 + ((low >> 16) & 0xFF)] ^ t[4 * 256 + (low >> 24)]
+            ^ t[3 * 256 + (high & 0xFF)] ^ t[2 * 256 + ((high >> 8) & 0xFF)] ^ t[256 + ((high >> 16) & 0xFF)] ^ t[high >> 24];
+    }
+    for (; i < n; ++i)
+    {
+        crc = t[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// Runs the chosen engine over a histogram and keeps only the code lengths
+void code_lengths(const long long counts[256], uint8_t lengths[256])
+{
+    // The engines count in ints; halve a larger total (keeping every symbol) until it fits
+    long long scaled[256], total = 0;
+    int shift = 0;
+    do
+    {
+        total = 0;
+        for (int c = 0; c < 256; ++c)
+        {
+            scaled[c] = counts[c] == 0 ? 0 : max(1LL, counts[c] >> shift);
+            total += scaled[c];
+        }
+        ++shift;
+    } while (total > (1 << 30));
+
+    vector<pair<char, int>> symbols;
+    for (int c = 0; c < 256; ++c)
+    {
+        if (scaled[c] != 0)
+        {
+            symbols.push_back(make_pair((char)c, (int)scaled[c]));
+        }
+    }
+    sort(symbols.begin(), symbols.end(), custom_comparator);
+    map<char, string> codes;
+    if (!symbols.empty())
+    {
+        code_engine->build(symbols, total, codes);
+    }
+    memset(lengths, 0, 256);
+    for (const auto& code : codes)
+    {
+        // A lone symbol gets an empty Shannon code, but the decoder needs a bit to count
+        lengths[(unsigned char)code.first] = max<size_t>(code.second.size(), 1);
+    }
+}
+
+// Canonical codes for the given lengths: shorter codes first, then by byte value.
+// Returns false if the lengths cannot form a prefix code.
+bool canonical_codes(const uint8_t lengths[256], uint64_t codes[256])
+{
+    int count[MAX_CODE_BITS + 1] = {0};
+    for (int c = 0; c < 256; ++c)
+    {
+        if (lengths[c] > MAX_CODE_BITS)
+        {
+            return false;
+        }
+        count[lengths[c]]++;
+    }
+    uint64_t next[MAX_CODE_BITS + 2] = {0};
+    uint64_t code = 0;
+    for (int len = 1; len <= MAX_CODE_BITS; ++len)
+    {
+        code = (code + count[len - 1] * (len > 1)) << 1;
+        next[len] = code;
+        if (count[len] > 0 && code + count[len] > (1ULL << len))
+        {
+            return false; // More codes of this length than are left
+        }
+    }
+    for (int c = 0; c < 256; ++c)
+    {
+        int len = lengths[c];
+        codes[c] = 0;
+        if (len == 0)
+        {
+            continue;
+        }
+        // The bits are written first bit lowest, so reverse the code
+        uint64_t value = next[len]++;
+        for (int b = 0; b < len; ++b)
+        {
+            codes[c] |= ((value >> (len - 1 - b)) & 1) << b;
+        }
+    }
+    return true;
+}
+
+// Histogram, codes and packed bits of one block
+void pack_block(ContainerJob* job, size_t index)
+{
+    ContainerBlock& block = job->blocks[index];
+    const unsigned char* input = job->input + block.input_offset;
+    size_t n = block.input_size;
+    block.crc = crc32(input, n);
+    if (job->shared)
+    {
+        memcpy(block.lengths, job->shared_lengths, 256);
+    }
+    else
+    {
+        long long counts[256] = {0};
+        for (size_t i = 0; i < n; ++i)
+        {
+            counts[input[i]]++;
+        }
+        STATS_LAP(STAGE_HISTOGRAM);
+        code_lengths(counts, block.lengths);
+        STATS_LAP(STAGE_CODES);
+    }
+
+    uint64_t codes[256];
+    canonical_codes(block.lengths, codes);
+    PackedCodes packed;
+    int longest = 0;
+    for (int c = 0; c < 256; ++c)
+    {
+        packed.code[c] = codes[c];
+        packed.length[c] = block.lengths[c];
+        longest = max(longest, (int)block.lengths[c]);
+    }
+    packed.fits = longest <= 32;
+
+    vector<uint64_t> words(n * longest / 64 + 2, 0);
+    size_t bits = 0;
+    if (packed.fits)
+    {
+        bits = encode_kernel().pack(packed, input, n, words.data());
+    }
+    else
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            put_bits(words.data(), bits, codes[input[i]]);
+            bits += block.lengths[input[i]];
+        }
+    }
+    block.bit_count = bits;
+    block.bits.resize((bits + 7) / 8);
+    memcpy(block.bits.data(), words.data(), block.bits.size()); // Words are little-endian on the targets we build for
+    STATS_LAP(STAGE_ENCODE);
+    STATS_ADD(bytes_in, n);
+    STATS_ADD(bits_out, bits);
+}
+
+// Decoding tables for one set of code lengths. Codes of up to DECODE_TABLE_BITS
+// bits are found with a single lookup of the next bits; longer ones are walked
+// one bit at a time through the canonical first code of each length.
+struct DecodeTable
+{
+    uint8_t fast_symbol[1 << DECODE_TABLE_BITS];
+    uint8_t fast_length[1 << DECODE_TABLE_BITS]; // 0: longer code (or no code)
+    int count[MAX_CODE_BITS + 1];
+    uint64_t first[MAX_CODE_BITS + 1];
+    int start[MAX_CODE_BITS + 1];                // Index into sorted of the first code of each length
+    uint8_t sorted[256];                         // Byte values in canonical order
+};
+
+bool build_decode_table(const uint8_t lengths[256], DecodeTable& table)
+{
+    uint64_t codes[256];
+    if (!canonical_codes(lengths, codes))
+    {
+        return false;
+    }
+    memset(table.fast_length, 0, sizeof(table.fast_length));
+    memset(table.count, 0, sizeof(table.count));
+    int sorted = 0;
+    uint64_t code = 0;
+    for (int len = 1; len <= MAX_CODE_BITS; ++len)
+    {
+        table.start[len] = sorted;
+        table.first[len] = code;
+        for (int c = 0; c < 256; ++c)
+        {
+            if (lengths[c] == len)
+            {
+                table.sorted[sorted++] = c;
+                table.count[len]++;
+                code++;
+            }
+        }
+        code <<= 1;
+        if (len > DECODE_TABLE_BITS)
+        {
+            continue;
+        }
+        for (int c = 0; c < 256; ++c)
+        {
+            if (lengths[c] != len)
+            {
+                continue;
+            }
+            // Every window whose low bits are this code decodes to it
+            for (uint64_t fill = codes[c]; fill < (1u << DECODE_TABLE_BITS); fill += 1ULL << len)
+            {
+                table.fast_symbol[fill] = c;
+                table.fast_length[fill] = len;
+            }
+        }
+    }
+    return true;
+}
+
+// Reads one block's table and bits from the container and decodes it into the output.
+// Runs on a worker, so a failure is left in block.error for the main thread to report.
+void unpack_block(ContainerJob* job, size_t index)
+{
+    ContainerBlock& block = job->blocks[index];
+    uint8_t lengths[256];
+    if (pread(job->fd, lengths, 256, block.table_offset) != 256)
+    {
+        block.error = "cannot read its code table";
+        return;
+    }
+    DecodeTable table;
+    if (!build_decode_table(lengths, table))
+    {
+        block.error = "invalid code table";
+        return;
+    }
+
+    // Eight bytes of padding so the bit window can always load a whole word
+    size_t size = (block.bit_count + 7) / 8;
+    vector<unsigned char> bits(size + 8, 0);
+    if ((size_t)pread(job->fd, bits.data(), size, block.bit_offset / 8) != size)
+    {
+        block.error = "truncated";
+        return;
+    }
+
+    // Locals, so the byte stores to out cannot force the loop to reload them
+    unsigned char* out = (unsigned char*)job->output + (block.input_offset - job->output_offset);
+    const unsigned char* in = bits.data();
+    const uint64_t bit_count = block.bit_count;
+    const uint32_t symbols = block.input_size;
+    uint64_t position = 0;
+    for (uint32_t i = 0; i < symbols; ++i)
+    {
+        uint64_t window;
+        memcpy(&window, in + (position >> 3), 8);
+        window >>= position & 7; // At least 57 valid bits
+        size_t slot = window & ((1u << DECODE_TABLE_BITS) - 1);
+        int len = table.fast_length[slot];
+        if (len != 0)
+        {
+            out[i] = table.fast_symbol[slot];
+        }
+        else
+        {
+            uint64_t code = 0;
+            for (len = 1; len <= MAX_CODE_BITS; ++len)
+            {
+                code = (code << 1) | ((window >> (len - 1)) & 1);
+                if (code - table.first[len] < (uint64_t)table.count[len])
+                {
+                    out[i] = table.sorted[table.start[len] + (code - table.first[len])];
+                    break;
+                }
+            }
+            if (len > MAX_CODE_BITS)
+            {
+                block.error = "invalid code";
+                return;
+            }
+        }
+        position += len;
+        if (position > bit_count)
+        {
+            block.error = "ends in the middle of a code";
+            return;
+        }
+    }
+    if (crc32(out, block.input_size) != block.crc)
+    {
+        block.error = "checksum mismatch";
+        return;
+    }
+    STATS_LAP(STAGE_DECODE);
+    STATS_ADD(bytes_in, block.input_size);
+}
+
+// Work-stealing scheduler. Each worker owns a deque of tasks: it pushes and pops
+// at the back and idle workers steal from the front. Messages longer than
+// SPLIT_SIZE are split into per-chunk histogram tasks and then per-chunk encode
+// tasks, so one huge message is spread over every core while the small ones are
+// stolen by whoever is free. Whichever sub-task finishes a phase last starts the
+// next one, so no worker ever blocks waiting for another. Container blocks are
+// scheduled the same way, one task per block.
+const size_t SPLIT_SIZE = 256 * 1024;
+
+// Large message whose histogram and encoding are done in SPLIT_SIZE chunks
+struct SplitJob
+{
+    EncodedResult* result;
+    size_t chunks;
+    vector<long long> chunk_counts; // 256 counters per chunk
+    vector<string> chunk_encoded;   // Encoded output of each chunk
+    string codes[256];              // Code of each byte value
+    PackedCodes packed;             // The same codes for the encode kernels
+    atomic<size_t> remaining;       // Sub-tasks of the current phase still running
+};
+
+enum TaskType { TASK_MESSAGE, TASK_HISTOGRAM, TASK_ENCODE, TASK_PACK_BLOCK, TASK_UNPACK_BLOCK };
+
+struct Task
+{
+    TaskType type;
+    EncodedResult* result;   // TASK_MESSAGE
+    SplitJob* job;           // TASK_HISTOGRAM and TASK_ENCODE
+    size_t chunk;            // Chunk, or block of a container
+    ContainerJob* container; // TASK_PACK_BLOCK and TASK_UNPACK_BLOCK
+};
+
+struct Worker
+{
+    pthread_mutex_t lock;  // Protects tasks
+    deque<Task> tasks;
+    pthread_t thread;
+    unsigned seed;         // For picking steal victims
+};
+
+struct Scheduler
+{
+    vector<Worker> workers;
+    pthread_mutex_t idle_lock;  // Protects done and sleeping
+    pthread_cond_t idle_cond;   // Signalled when work is pushed or everything is done
+    int sleeping;
+    bool done;
+    atomic<size_t> queued;      // Tasks sitting in any deque
+    atomic<size_t> unfinished;  // Messages (or container blocks) not finished yet
+};
+
+static Scheduler scheduler;
+
+void push_task(Worker& worker, const Task& task)
+{
+    pthread_mutex_lock(&worker.lock);
+    worker.tasks.push_back(task);
+    pthread_mutex_unlock(&worker.lock);
+    scheduler.queued++;
+
+    // Wake a sleeping worker so it can steal the new task
+    pthread_mutex_lock(&scheduler.idle_lock);
+    if (scheduler.sleeping > 0)
+    {
+        pthread_cond_signal(&scheduler.idle_cond);
+    }
+    pthread_mutex_unlock(&scheduler.idle_lock);
+}
+
+// Takes the newest task from our own deque, or failing that the oldest task of another worker
+bool take_task(size_t self, Task& task)
+{
+    Worker& worker = scheduler.workers[self];
+    pthread_mutex_lock(&worker.lock);
+    bool found = !worker.tasks.empty();
+    if (found)
+    {
+        task = worker.tasks.back();
+        worker.tasks.pop_back();
+    }
+    pthread_mutex_unlock(&worker.lock);
+
+    size_t count = scheduler.workers.size();
+    size_t start = rand_r(&worker.seed) % count;
+    for (size_t i = 0; !found && i < count; ++i)
+    {
+        Worker& victim = scheduler.workers[(start + i) % count];
+        if (&victim == &worker)
+        {
+            continue;
+        }
+        pthread_mutex_lock(&victim.lock);
+        found = !victim.tasks.empty();
+        if (found)
+        {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            STATS_ADD(steals, 1);
+        }
+        pthread_mutex_unlock(&victim.lock);
+    }
+    if (found)
+    {
+        scheduler.queued--;
+    }
+    return found;
+}
+
+// Called once per message or container block; the last one lets the workers exit
+void finish_work()
+{
+    if (--scheduler.unfinished == 0)
+    {
+        pthread_mutex_lock(&scheduler.idle_lock);
+        scheduler.done = true;
+        pthread_cond_broadcast(&scheduler.idle_cond);
+        pthread_mutex_unlock(&scheduler.idle_lock);
+    }
+}
+
+void finish_message()
+{
+    STATS_ADD(messages, 1);
+    finish_work();
+}
+
+void run_task(Worker& worker, const Task& task)
+{
+    STATS_START();
+    STATS_ADD(tasks, 1);
+    if (task.type == TASK_MESSAGE)
+    {
+        EncodedResult* result = task.result;
+        size_t length = result->message.size();
+        if (length <= SPLIT_SIZE)
+        {
+            shannon_coding(result->message, *result); // Perform Shannon coding on the input string
+            finish_message();
+            return;
+        }
+
+        // Too big for one task: count each chunk separately
+        SplitJob* job = new SplitJob;
+        job->result = result;
+        job->chunks = (length + SPLIT_SIZE - 1) / SPLIT_SIZE;
+        job->chunk_counts.assign(job->chunks * 256, 0);
+        job->chunk_encoded.resize(job->chunks);
+        job->remaining = job->chunks;
+        for (size_t c = 0; c < job->chunks; ++c)
+        {
+            push_task(worker, Task{TASK_HISTOGRAM, nullptr, job, c, nullptr});
+        }
+        STATS_ADD(bytes_in, length);
+    }
+    else if (task.type == TASK_HISTOGRAM)
+    {
+        SplitJob* job = task.job;
+        const string& input = job->result->message;
+        size_t begin = task.chunk * SPLIT_SIZE, end = min(begin + SPLIT_SIZE, input.size());
+        long long* counts = &job->chunk_counts[task.chunk * 256];
+        for (size_t i = begin; i < end; ++i)
+        {
+            counts[(unsigned char)input[i]]++;
+        }
+        STATS_LAP(STAGE_HISTOGRAM);
+        if (--job->remaining != 0)
+        {
+            return;
+        }
+
+        // Last chunk counted: merge the counts, build the codes and start encoding
+        map<char, int> frequency;
+        for (int c = 0; c < 256; ++c)
+        {
+            long long total = 0;
+            for (size_t k = 0; k < job->chunks; ++k)
+            {
+                total += job->chunk_counts[k * 256 + c];
+            }
+            if (total != 0)
+            {
+                frequency[(char)c] = total;
+            }
+        }
+        vector<long long>().swap(job->chunk_counts);
+        STATS_LAP(STAGE_HISTOGRAM);
+        build_codes(frequency, input.size(), *job->result);
+        for (const auto& code : job->result->shannon_algorithm)
+        {
+            job->codes[(unsigned char)code.first] = code.second;
+        }
+        pack_codes(job->codes, job->packed);
+        job->remaining = job->chunks;
+        for (size_t c = 0; c < job->chunks; ++c)
+        {
+            push_task(worker, Task{TASK_ENCODE, nullptr, job, c, nullptr});
+        }
+    }
+    else if (task.type == TASK_PACK_BLOCK)
+    {
+        pack_block(task.container, task.chunk);
+        finish_work();
+    }
+    else if (task.type == TASK_UNPACK_BLOCK)
+    {
+        unpack_block(task.container, task.chunk);
+        finish_work();
+    }
+    else
+    {
+        SplitJob* job = task.job;
+        const string& input = job->result->message;
+        size_t begin = task.chunk * SPLIT_SIZE, end = min(begin + SPLIT_SIZE, input.size());
+        string& encoded = job->chunk_encoded[task.chunk];
+        encode_symbols(job->codes, job->packed, input.data() + begin, end - begin, encoded);
+        STATS_LAP(STAGE_ENCODE);
+        if (--job->remaining != 0)
+        {
+            return;
+        }
+
+        // Last chunk encoded: join the pieces in order
+        size_t total = 0;
+        for (const auto& piece : job->chunk_encoded)
+        {
+            total += piece.size();
+        }
+        job->result->encoded_string.reserve(total);
+        for (const auto& piece : job->chunk_encoded)
+        {
+            job->result->encoded_string += piece;
+        }
+        STATS_LAP(STAGE_ENCODE);
+        STATS_ADD(bits_out, total);
+        delete job;
+        finish_message();
+    }
+}
+
+// Thread function that runs tasks until every message is encoded
+void* worker_thread(void* arg) 
+{
+    size_t self = (size_t)arg;
+    Task task;
+    while (true)
+    {
+        if (take_task(self, task))
+        {
+            run_task(scheduler.workers[self], task);
+            continue;
+        }
+
+        // Nothing to run or steal: sleep until more work is pushed or everything is done
+        pthread_mutex_lock(&scheduler.idle_lock);
+        while (!scheduler.done && scheduler.queued == 0)
+        {
+            scheduler.sleeping++;
+            pthread_cond_wait(&scheduler.idle_cond, &scheduler.idle_lock);
+            scheduler.sleeping--;
+        }
+        bool done = scheduler.done;
+        pthread_mutex_unlock(&scheduler.idle_lock);
+        if (done)
+        {
+            break;
+        }
+    }
+    pthread_exit(nullptr); 
+}
+
+void usage(const char* program)
+{
+    cerr << "usage " << program << " [-e engine] [-r] [threads]" << endl
+         << "      " << program << " [-e engine] [-b block_size] [-s] pack input container [threads]" << endl
+         << "      " << program << " unpack container output [threads]" << endl
+         << "      " << program << " extract container offset length [threads]" << endl;
+    exit(1);
+}
+
+// One worker per core unless a thread count is given at argv[index]. A count
+// must be a whole number no larger than four workers per core.
+long thread_count_arg(int argc, char* argv[], int index)
+{
+    long cores = max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    if (argc <= index)
+    {
+        return cores;
+    }
+    char* end;
+    errno = 0;
+    long thread_count = strtol(argv[index], &end, 10);
+    if (errno != 0 || end == argv[index] || *end != '\0' || thread_count < 1 || thread_count > 4 * cores)
+    {
+        cerr << "Thread count must be between 1 and " << 4 * cores << endl;
+        usage(argv[0]);
+    }
+    return thread_count;
+}
+
+// Runs the tasks (and everything they spawn) on thread_count workers and returns
+// once all of them are finished
+void run_workers(long thread_count, const vector<Task>& tasks)
+{
+    // Deal the tasks out round-robin; stealing evens out whatever is left unbalanced
+    scheduler.workers.clear();
+    scheduler.workers.resize(thread_count);
+    pthread_mutex_init(&scheduler.idle_lock, nullptr);
+    pthread_cond_init(&scheduler.idle_cond, nullptr);
+    scheduler.sleeping = 0;
+    scheduler.done = tasks.empty();
+    scheduler.queued = tasks.size();
+    scheduler.unfinished = tasks.size();
+    for (long w = 0; w < thread_count; ++w)
+    {
+        pthread_mutex_init(&scheduler.workers[w].lock, nullptr);
+        scheduler.workers[w].seed = w + 1;
+    }
+    for (size_t i = 0; i < tasks.size(); ++i)
+    {
+        scheduler.workers[i % thread_count].tasks.push_back(tasks[i]);
+    }
+
+    // Create and launch the workers using POSIX threads (pthreads)
+    for (long w = 0; w < thread_count; ++w)
+    {
+        pthread_create(&scheduler.workers[w].thread, nullptr, worker_thread, (void*)w);
+    }
+
+    // Join the threads
+    for (long w = 0; w < thread_count; ++w)
+    {
+        pthread_join(scheduler.workers[w].thread, nullptr);
+    }
+    for (long w = 0; w < thread_count; ++w)
+    {
+        pthread_mutex_destroy(&scheduler.workers[w].lock);
+    }
+    pthread_mutex_destroy(&scheduler.idle_lock);
+    pthread_cond_destroy(&scheduler.idle_cond);
+}
+
+// Reads a whole file ("-" for standard input)
+void read_file(const char* path, string& data)
+{
+    FILE* file = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (file == nullptr)
+    {
+        container_error(string("Cannot open ") + path + ": " + strerror(errno));
+    }
+    char buffer[1 << 16];
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        data.append(buffer, got);
+    }
+    if (ferror(file))
+    {
+        container_error(string("Cannot read ") + path);
+    }
+    if (file != stdin)
+    {
+        fclose(file);
+    }
+}
+
+FILE* open_output(const char* path)
+{
+    FILE* file = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+    if (file == nullptr)
+    {
+        container_error(string("Cannot create ") + path + ": " + strerror(errno));
+    }
+    return file;
+}
+
+void write_output(FILE* file, const void* data, size_t size)
+{
+    if (size != 0 && fwrite(data, 1, size, file) != size)
+    {
+        container_error("Write failed");
+    }
+}
+
+void close_output(FILE* file)
+{
+    if (fflush(file) != 0 || (file != stdout && fclose(file) != 0))
+    {
+        container_error("Write failed");
+    }
+}
+
+// pack: codes the input in blocks of block_size bytes, one task per block, then
+// writes the header, the blocks in order, the index and the footer
+void pack_container(const char* input_path, const char* container_path, size_t block_size, bool shared, long thread_count)
+{
+    STATS_START();
+    string input;
+    read_file(input_path, input);
+    ContainerJob job;
+    job.input = (const unsigned char*)input.data();
+    job.shared = shared;
+    if (shared)
+    {
+        // One table for the whole input, built before the blocks are packed
+        long long counts[256] = {0};
+        for (unsigned char ch : input)
+        {
+            counts[ch]++;
+        }
+        STATS_LAP(STAGE_HISTOGRAM);
+        code_lengths(counts, job.shared_lengths);
+        STATS_LAP(STAGE_CODES);
+    }
+    for (size_t offset = 0; offset < input.size(); offset += block_size)
+    {
+        job.blocks.emplace_back();
+        job.blocks.back().input_offset = offset;
+        job.blocks.back().input_size = min(block_size, input.size() - offset);
+    }
+    vector<Task> tasks;
+    for (size_t b = 0; b < job.blocks.size(); ++b)
+    {
+        tasks.push_back(Task{TASK_PACK_BLOCK, nullptr, nullptr, b, &job});
+    }
+    run_workers(thread_count, tasks);
+
+    STATS_START();
+    FILE* file = open_output(container_path);
+    string header = "SHNC";
+    put_le(header, CONTAINER_VERSION, 4);
+    put_le(header, block_size, 4);
+    put_le(header, code_engine - code_engines, 4);
+    put_le(header, input.size(), 8);
+    uint64_t offset = CONTAINER_HEADER_SIZE;
+    if (shared)
+    {
+        header.append((const char*)job.shared_lengths, 256);
+        offset += 256;
+    }
+    write_output(file, header.data(), header.size());
+
+    string index;
+    for (auto& block : job.blocks)
+    {
+        if (shared)
+        {
+            block.table_offset = CONTAINER_HEADER_SIZE;
+        }
+        else
+        {
+            block.table_offset = offset;
+            write_output(file, block.lengths, 256);
+            offset += 256;
+        }
+        block.bit_offset = offset * 8;
+        write_output(file, block.bits.data(), block.bits.size());
+        offset += block.bits.size();
+        vector<uint8_t>().swap(block.bits);
+
+        put_le(index, block.input_offset, 8);
+        put_le(index, block.bit_offset, 8);
+        put_le(index, block.bit_count, 8);
+        put_le(index, block.table_offset, 8);
+        put_le(index, block.input_size, 4);
+        put_le(index, block.crc, 4);
+    }
+    string footer;
+    put_le(footer, offset, 8);
+    put_le(footer, job.blocks.size(), 4);
+    put_le(footer, crc32((const unsigned char*)index.data(), index.size()), 4);
+    footer += "SHNI";
+    write_output(file, index.data(), index.size());
+    write_output(file, footer.data(), footer.size());
+    close_output(file);
+    STATS_LAP(STAGE_OUTPUT);
+}
+
+// Opens a container and reads its index; anything inconsistent is reported as damage
+void open_container(const char* path, ContainerJob& job, uint64_t& input_size)
+{
+    job.fd = open(path, O_RDONLY);
+    if (job.fd < 0)
+    {
+        container_error(string("Cannot open ") + path + ": " + strerror(errno));
+    }
+    struct stat info;
+    if (fstat(job.fd, &info) < 0)
+    {
+        container_error(string("Cannot stat ") + path + ": " + strerror(errno));
+    }
+    uint64_t file_size = info.st_size;
+    unsigned char header[CONTAINER_HEADER_SIZE], footer[CONTAINER_FOOTER_SIZE];
+    if (file_size < CONTAINER_HEADER_SIZE + CONTAINER_FOOTER_SIZE
+        || pread(job.fd, header, sizeof(header), 0) != (ssize_t)sizeof(header)
+        || pread(job.fd, footer, sizeof(footer), file_size - sizeof(footer)) != (ssize_t)sizeof(footer)
+        || memcmp(header, "SHNC", 4) != 0 || memcmp(footer + 16, "SHNI", 4) != 0)
+    {
+        container_error(string(path) + " is not a container");
+    }
+    if (get_le(header + 4, 4) != CONTAINER_VERSION)
+    {
+        container_error(string(path) + ": unsupported container version " + to_string(get_le(header + 4, 4)));
+    }
+    input_size = get_le(header + 16, 8);
+
+    // Every check below subtracts from values already known to be in range, so a
+    // crafted offset cannot wrap a sum around and pass
+    uint64_t index_offset = get_le(footer, 8);
+    uint64_t count = get_le(footer + 8, 4);
+    if (count > (file_size - CONTAINER_FOOTER_SIZE) / CONTAINER_ENTRY_SIZE
+        || index_offset != file_size - CONTAINER_FOOTER_SIZE - count * CONTAINER_ENTRY_SIZE
+        || index_offset < CONTAINER_HEADER_SIZE)
+    {
+        container_error(string(path) + ": damaged index");
+    }
+    vector<unsigned char> index(count * CONTAINER_ENTRY_SIZE);
+    if ((size_t)pread(job.fd, index.data(), index.size(), index_offset) != index.size()
+        || crc32(index.data(), index.size()) != get_le(footer + 12, 4))
+    {
+        container_error(string(path) + ": damaged index");
+    }
+
+    uint64_t expected = 0;
+    job.blocks.resize(count);
+    for (size_t b = 0; b < count; ++b)
+    {
+        const unsigned char* entry = &index[b * CONTAINER_ENTRY_SIZE];
+        ContainerBlock& block = job.blocks[b];
+        block.input_offset = get_le(entry, 8);
+        block.bit_offset = get_le(entry + 8, 8);
+        block.bit_count = get_le(entry + 16, 8);
+        block.table_offset = get_le(entry + 24, 8);
+        block.input_size = get_le(entry + 32, 4);
+        block.crc = get_le(entry + 36, 4);
+        if (block.input_offset != expected || block.input_size == 0 || block.input_size > CONTAINER_MAX_BLOCK
+            || block.bit_offset % 8 != 0 || block.bit_offset / 8 > index_offset
+            || block.bit_count > (index_offset - block.bit_offset / 8) * 8
+            || index_offset < 256 || block.table_offset > index_offset - 256)
+        {
+            container_error(string(path) + ": damaged index entry " + to_string(b));
+        }
+        expected += block.input_size;
+    }
+    if (expected != input_size)
+    {
+        container_error(string(path) + ": index does not cover the input");
+    }
+}
+
+// Decodes blocks [first, last] in parallel into output (which starts at the first block's input)
+void unpack_blocks(ContainerJob& job, size_t first, size_t last, string& output, long thread_count)
+{
+    uint64_t begin = job.blocks[first].input_offset;
+    uint64_t end = job.blocks[last].input_offset + job.blocks[last].input_size;
+    output.resize(end - begin);
+    job.output = &output[0];
+    job.output_offset = begin;
+    vector<Task> tasks;
+    for (size_t b = first; b <= last; ++b)
+    {
+        tasks.push_back(Task{TASK_UNPACK_BLOCK, nullptr, nullptr, b, &job});
+    }
+    run_workers(thread_count, tasks);
+    // Exit only now that no worker is running
+    for (size_t b = first; b <= last; ++b)
+    {
+        if (!job.blocks[b].error.empty())
+        {
+            container_error("Block " + to_string(b) + ": " + job.blocks[b].error);
+        }
+    }
+}
+
+// unpack: decodes every block and writes the original input
+void unpack_container(const char* container_path, const char* output_path, long thread_count)
+{
+    ContainerJob job;
+    uint64_t input_size;
+    open_container(container_path, job, input_size);
+    string output;
+    if (!job.blocks.empty())
+    {
+        unpack_blocks(job, 0, job.blocks.size() - 1, output, thread_count);
+    }
+    close(job.fd);
+    STATS_START();
+    FILE* file = open_output(output_path);
+    write_output(file, output.data(), output.size());
+    close_output(file);
+    STATS_LAP(STAGE_OUTPUT);
+}
+
+// extract: writes bytes [offset, offset + length) of the original input to
+// standard output, decoding only the blocks that overlap them
+void extract_container(const char* container_path, uint64_t offset, uint64_t length, long thread_count)
+{
+    ContainerJob job;
+    uint64_t input_size;
+    open_container(container_path, job, input_size);
+    if (offset > input_size)
+    {
+        container_error("Offset " + to_string(offset) + " is past the end of the input (" + to_string(input_size) + " bytes)");
+    }
+    length = min(length, input_size - offset);
+    string output;
+    if (length > 0)
+    {
+        // The last block starting at or before each end of the range
+        auto block_of = [&](uint64_t position)
+        {
+            auto it = upper_bound(job.blocks.begin(), job.blocks.end(), position,
+                                  [](uint64_t value, const ContainerBlock& block) { return value < block.input_offset; });
+            return (size_t)(it - job.blocks.begin()) - 1;
+        };
+        size_t first = block_of(offset), last = block_of(offset + length - 1);
+        unpack_blocks(job, first, last, output, thread_count);
+        offset -= job.blocks[first].input_offset;
+    }
+    close(job.fd);
+    STATS_START();
+    write_output(stdout, output.data() + (length > 0 ? offset : 0), length);
+    close_output(stdout);
+    STATS_LAP(STAGE_OUTPUT);
+}
+
+// Parses a byte offset or length given on the command line
+uint64_t parse_count(const char* text, const char* what)
+{
+    char* end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || text[0] == '-')
+    {
+        container_error(string("Invalid ") + what + ": " + text);
+    }
+    return value;
+}
+
+// Handles the container commands; returns false if argv[index] is not one of them
+bool container_command(int argc, char* argv[], int index, size_t block_size, bool shared)
+{
+    if (index >= argc)
+    {
+        return false;
+    }
+    string command = argv[index];
+    int operands = command == "pack" || command == "unpack" ? 2 : command == "extract" ? 3 : 0;
+    if (operands == 0)
+    {
+        return false;
+    }
+    if (argc < index + 1 + operands)
+    {
+        cerr << "usage " << argv[0] << " " << command
+             << (command == "pack" ? " input container" : command == "unpack" ? " container output" : " container offset length")
+             << " [threads]" << endl;
+        exit(1);
+    }
+    char** operand = argv + index + 1;
+    long thread_count = thread_count_arg(argc, argv, index + 1 + operands);
+    if (command == "pack")
+    {
+        pack_container(operand[0], operand[1], block_size, shared, thread_count);
+    }
+    else if (command == "unpack")
+    {
+        unpack_container(operand[0], operand[1], thread_count);
+    }
+    else
+    {
+        extract_container(operand[0], parse_count(operand[1], "offset"), parse_count(operand[2], "length"), thread_count);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) 
+{
+    string line; // Temporary variable to hold each input line
+    vector<EncodedResult> results; // Vector to store results for each thread
+
+    // Options: -e picks the code engine, -r reports how close the codes get to the entropy,
+    // -b and -s set the block size and a shared code table for the pack command
+    int opt;
+    size_t block_size = 1 << 20;
+    bool shared = false;
+    bool pack_options = false; // -b or -s given
+    while ((opt = getopt(argc, argv, "e:rb:s")) != -1)
+    {
+        if (opt == 'e')
+        {
+            code_engine = find_engine(optarg);
+        }
+        else if (opt == 'r')
+        {
+            report_efficiency = true;
+        }
+        else if (opt == 'b')
+        {
+            uint64_t size = parse_count(optarg, "block size");
+            if (size < 1 || size > CONTAINER_MAX_BLOCK)
+            {
+                cerr << "Block size must be between 1 and " << CONTAINER_MAX_BLOCK << " bytes" << endl;
+                exit(1);
+            }
+            block_size = size;
+            pack_options = true;
+        }
+        else if (opt == 's')
+        {
+            shared = true;
+            pack_options = true;
+        }
+        else
+        {
+            usage(argv[0]);
+        }
+    }
+
+    if (pack_options && (optind >= argc || strcmp(argv[optind], "pack") != 0))
+    {
+        cerr << "-b and -s only apply to the pack command" << endl;
+        exit(1);
+    }
+
+    STATS_INIT(); // Dump counters on SIGUSR1 (no-op unless built with -DSHANNON_STATS)
+
+    if (container_command(argc, argv, optind, block_size, shared))
+    {
+        STATS_DUMP();
+        return 0;
+    }
+    long thread_count = thread_count_arg(argc, argv, optind); // Checked before any input is read
+
+    // Reading input strings from standard input 
+    while (getline(cin, line)) 
+    { // Read each line of input
+        if (!line.empty()) { 
+            EncodedResult result;
+            result.message = line; // Store the input message
+            results.push_back(result); // Store the result
+        }
+    }
+
+    // Deal the messages out to the workers and wait until all are encoded
+    vector<Task> tasks;
+    for (size_t i = 0; i < results.size(); ++i) 
+    {
+        tasks.push_back(Task{TASK_MESSAGE, &results[i], nullptr, 0, nullptr});
+    }
+    run_workers(thread_count, tasks);
+
+    // Output results 
+    STATS_START();
+    for (const auto& result : results) 
+    {
+        cout << "Message: " << result.message << endl << endl;
+        cout << "Alphabet: " << endl;
+        for (const auto& ch_pair : result.sorted_symbols)
+        {
+            char ch = ch_pair.first;
+            int freq = ch_pair.second;
+            cout << "Symbol: " << ch 
+                 << ", Frequency: " << freq 
+                 << ", " << code_engine->label << ": " << result.shannon_algorithm.at(ch) << endl; 
+        }
+        if (report_efficiency)
+        {
+            cout << efficiency_line(result.sorted_symbols, result.shannon_algorithm) << endl;
         }
         cout << "\nEncoded message: " << result.encoded_string << endl << endl; 
     }
+    STATS_LAP(STAGE_OUTPUT);
+    STATS_DUMP();
 
     return 0;
 }
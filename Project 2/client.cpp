@@ -7,12 +7,69 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <strings.h>
+#include <poll.h>
+#include <deque>
+#include <chrono>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <new>
+#include <sched.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+
+#ifdef SHANNON_STATS
+#include <csignal>
+#include <cstdio>
+#endif
+
+// A msgSize of FRAME_STATS asks the server for its statistics instead of encoding a message
+const int FRAME_STATS = -1;
+
+// A msgSize of FRAME_CHUNKED starts a chunked upload: [int length][bytes] chunks
+// ending with a zero length. The response comes back chunked the same way.
+const int FRAME_CHUNKED = -2;
+
+// A msgSize of FRAME_BATCH carries several messages in one request:
+// [int count][int payloadSize][int offsets[count]][payload]. The response has
+// the same layout with the response text of each message as the payload.
+const int FRAME_BATCH = -3;
+
+// A msgSize of FRAME_SHM, sent over the Unix socket, switches the connection to
+// the shared-memory transport: the memfd holding the two rings and two eventfds
+// (the client's, then the server's) follow with SCM_RIGHTS
+const int FRAME_SHM = -4;
+
+// A msgSize of FRAME_OPTIONS is followed by [int engine][int flags] and applies to
+// the requests after it on the same connection. Nothing is sent back.
+const int FRAME_OPTIONS = -5;
+const int OPTION_REPORT = 1;  // Add a bits-per-symbol line to each alphabet
+
+// Code engines of the server, in the order FRAME_OPTIONS numbers them
+static const char *code_engine_names[] = { "shannon", "huffman", "limited12", "limited15" };
+
+// Largest chunk of a chunked upload; longer messages are sent chunked
+const size_t CHUNK_SIZE = 64 * 1024;
+
+// Lines are coalesced into one batch request until it holds BATCH_BYTES of
+// messages or BATCH_DELAY_MS has passed since its first line was read
+const size_t BATCH_BYTES = 64 * 1024;
+const int BATCH_DELAY_MS = 1;
+
+// Bytes in each shared-memory ring (a power of two)
+const uint64_t SHM_RING_BYTES = 4 * 1024 * 1024;
 
 // Function for error handling
 void error(const char *msg)
@@ -21,159 +78,1179 @@ void error(const char *msg)
     exit(1);
 }
 
-// Structure to hold data for each thread
-struct ThreadData
+#ifdef SHANNON_STATS
+// Instrumentation, only compiled in with -DSHANNON_STATS (the macros below expand
+// to nothing otherwise). Every thread claims a counter slot once and then only
+// touches its own slot, so recording never takes a lock.
+enum Stage { STAGE_RESOLVE, STAGE_CONNECT, STAGE_WRITE, STAGE_READ, STAGE_OUTPUT, STAGE_COUNT };
+static const char *stage_names[STAGE_COUNT] = { "resolve", "connect", "write", "read", "output" };
+
+const int STATS_SLOTS = 64; // Threads past this share slots round-robin (still lock-free)
+
+struct alignas(64) StatsSlot
 {
-    std::string input_message;     
-    std::string response_message;  
-    std::string hostname;          
-    int portno;                    
+    std::atomic<uint64_t> stage_ns[STAGE_COUNT];
+    std::atomic<uint64_t> stage_calls[STAGE_COUNT];
+    std::atomic<uint64_t> messages;
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> bytes_out;
+    std::atomic<uint64_t> bytes_in;
 };
 
-// Thread function that communicates with the server
-void *client_thread(void *arg)
+static StatsSlot stats_slots[STATS_SLOTS];
+static std::atomic<unsigned> stats_next_slot(0);
+static thread_local StatsSlot *stats_slot = NULL;
+static thread_local std::chrono::steady_clock::time_point stats_lap_start;
+
+static StatsSlot& stats_local()
 {
-    ThreadData *data = (ThreadData *)arg;
+    if (stats_slot == NULL)
+    {
+        stats_slot = &stats_slots[stats_next_slot.fetch_add(1, std::memory_order_relaxed) % STATS_SLOTS];
+    }
+    return *stats_slot;
+}
 
-    int sockfd, n;
-    struct sockaddr_in serv_addr;
-    struct hostent *server;
+// Charges the time since the previous lap (or STATS_START) to the given stage
+static void stats_lap(Stage stage)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    StatsSlot& slot = stats_local();
+    slot.stage_ns[stage].fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(now - stats_lap_start).count(), std::memory_order_relaxed);
+    slot.stage_calls[stage].fetch_add(1, std::memory_order_relaxed);
+    stats_lap_start = now;
+}
 
-    // Create a socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)
+// Sums every slot and prints the totals to stderr
+static void stats_dump()
+{
+    uint64_t ns[STAGE_COUNT] = {0}, calls[STAGE_COUNT] = {0}, messages = 0, requests = 0, bytes_out = 0, bytes_in = 0;
+    for (int i = 0; i < STATS_SLOTS; ++i)
     {
-        error("Error opening socket");
+        for (int s = 0; s < STAGE_COUNT; ++s)
+        {
+            ns[s] += stats_slots[i].stage_ns[s].load(std::memory_order_relaxed);
+            calls[s] += stats_slots[i].stage_calls[s].load(std::memory_order_relaxed);
+        }
+        messages += stats_slots[i].messages.load(std::memory_order_relaxed);
+        requests += stats_slots[i].requests.load(std::memory_order_relaxed);
+        bytes_out += stats_slots[i].bytes_out.load(std::memory_order_relaxed);
+        bytes_in += stats_slots[i].bytes_in.load(std::memory_order_relaxed);
+    }
+    fprintf(stderr, "[stats] messages: %llu, requests: %llu, bytes sent: %llu, bytes received: %llu\n",
+            (unsigned long long)messages, (unsigned long long)requests, (unsigned long long)bytes_out, (unsigned long long)bytes_in);
+    for (int s = 0; s < STAGE_COUNT; ++s)
+    {
+        fprintf(stderr, "[stats] %-10s calls: %-8llu total: %.3f ms, avg: %.3f us\n", stage_names[s],
+                (unsigned long long)calls[s], ns[s] / 1e6, calls[s] ? ns[s] / 1e3 / calls[s] : 0.0);
     }
+}
 
-    // Get the server's address by hostname
-    server = gethostbyname(data->hostname.c_str());
-    if (server == NULL)
+// Dumps the counters each time SIGUSR1 arrives; SIGUSR1 is blocked in every
+// other thread so the dump runs here instead of inside a signal handler
+static void *stats_signal_thread(void *arg)
+{
+    sigset_t *set = static_cast<sigset_t*>(arg);
+    int sig;
+    while (sigwait(set, &sig) == 0)
     {
-        fprintf(stderr, "ERROR, no such host\n");
-        pthread_exit(NULL);
+        stats_dump();
     }
+    return NULL;
+}
+
+static void stats_init()
+{
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL); // Inherited by every thread created afterwards
+    pthread_t tid;
+    pthread_create(&tid, NULL, stats_signal_thread, &set);
+    pthread_detach(tid);
+}
+
+#define STATS_INIT() stats_init()
+#define STATS_DUMP() stats_dump()
+#define STATS_START() (stats_lap_start = std::chrono::steady_clock::now())
+#define STATS_LAP(stage) stats_lap(stage)
+#define STATS_ADD(counter, n) stats_local().counter.fetch_add((n), std::memory_order_relaxed)
+#else
+#define STATS_INIT()
+#define STATS_DUMP()
+#define STATS_START()
+#define STATS_LAP(stage)
+#define STATS_ADD(counter, n)
+#endif
+
+// Writes exactly len bytes to the socket
+void write_fully(int sockfd, const void *buffer, size_t len)
+{
+    size_t totalBytesWritten = 0;
+    while (totalBytesWritten < len)
+    {
+        ssize_t n = write(sockfd, (const char *)buffer + totalBytesWritten, len - totalBytesWritten);
+        if (n < 0)
+        {
+            error("Error writing to socket");
+        }
+        totalBytesWritten += n;
+    }
+}
 
-    // Set up the server address structure
-    bzero((char *)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr,
-          (char *)&serv_addr.sin_addr.s_addr,
-          server->h_length);
-    serv_addr.sin_port = htons(data->portno);
+// Fills in the address of the server's Unix socket at path
+void unix_address(const std::string &path, struct sockaddr_un &addr)
+{
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "Unix socket path too long" << std::endl;
+        exit(1);
+    }
+    bzero((char *)&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+}
 
-    // Connect to the server
+// Connects to the server's Unix socket at path
+int connect_unix(const std::string &path)
+{
+    struct sockaddr_un serv_addr;
+    unix_address(path, serv_addr);
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0)
+    {
+        error("Error opening socket");
+    }
     if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
     {
         error("Error connecting");
     }
+    return sockfd;
+}
 
-    // Send the size of the message first
-    int msgSize = data->input_message.size();
-    n = write(sockfd, &msgSize, sizeof(int));
+// Reads standard input line by line without blocking longer than asked to
+struct LineReader
+{
+    std::string buffer;  // Bytes read but not returned yet, starting at start
+    size_t start;
+    size_t scanned;      // Bytes from start up to here hold no newline
+    bool eof;
+};
+
+// Returns 1 and sets line when a whole line is buffered, -1 at the end of the
+// input and 0 when more has to be read first
+int take_line(LineReader &reader, std::string &line)
+{
+    // Search only the bytes that arrived since the last look
+    size_t newline = reader.buffer.find('\n', reader.scanned);
+    if (newline != std::string::npos || (reader.eof && reader.start < reader.buffer.size()))
+    {
+        size_t end = newline != std::string::npos ? newline : reader.buffer.size();
+        line.assign(reader.buffer, reader.start, end - reader.start);
+        reader.start = end + 1;
+        reader.scanned = reader.start;
+        if (reader.start >= reader.buffer.size())
+        {
+            reader.buffer.clear();
+            reader.start = 0;
+            reader.scanned = 0;
+        }
+        return 1;
+    }
+    reader.scanned = reader.buffer.size();
+    return reader.eof ? -1 : 0;
+}
+
+// Reads once from standard input into the buffer
+void fill_line_reader(LineReader &reader)
+{
+    // Drop consumed bytes before reading more
+    reader.buffer.erase(0, reader.start);
+    reader.scanned -= reader.start;
+    reader.start = 0;
+    char chunk[64 * 1024];
+    ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
     if (n < 0)
     {
-        error("Error writing to socket");
+        if (errno == EINTR || errno == EAGAIN)
+        {
+            return;
+        }
+        error("Error reading from stdin");
+    }
+    if (n == 0)
+    {
+        reader.eof = true;
     }
+    reader.buffer.append(chunk, n);
+}
 
-    // Send the actual message to the server
-    int totalBytesWritten = 0;
-    while (totalBytesWritten < msgSize)
+// Returns 1 and sets line when a line is available, 0 if none became available
+// within timeout_ms (-1 waits forever) and -1 at the end of the input
+int next_line(LineReader &reader, std::string &line, int timeout_ms)
+{
+    int rc;
+    while ((rc = take_line(reader, line)) == 0)
     {
-        n = write(sockfd, data->input_message.c_str() + totalBytesWritten, msgSize - totalBytesWritten);
-        if (n < 0)
+        if (timeout_ms >= 0)
         {
-            error("Error writing to socket");
+            struct pollfd pfd;
+            pfd.fd = STDIN_FILENO;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, timeout_ms) == 0)
+            {
+                return 0;
+            }
         }
-        totalBytesWritten += n;
+        fill_line_reader(reader);
     }
+    return rc;
+}
 
-    // Read the size of the response from the server
-    int responseSize = 0;
-    n = read(sockfd, &responseSize, sizeof(int));
-    if (n < 0)
+// Shared-memory transport, laid out as in the server: a ShmHeader page, then a
+// request ring and a response ring of capacity bytes each. Records are a 4-byte
+// header (length and flags) and the payload padded to 8 bytes, never wrapping
+// around the end of a ring; larger messages go as several RECORD_MORE records.
+const uint32_t RECORD_MORE = 0x80000000u;
+const uint32_t RECORD_PAD = 0x40000000u;
+const uint32_t RECORD_LENGTH = 0x3fffffffu;
+const size_t SHM_HEADER_BYTES = 4096;
+const int SHM_SPIN = 64;
+
+struct Ring
+{
+    alignas(64) std::atomic<uint64_t> head;  // Bytes published by the producer so far
+    alignas(64) std::atomic<uint64_t> tail;  // Bytes released by the consumer so far
+};
+
+struct ShmHeader
+{
+    uint64_t capacity;  // Data bytes in each ring, a power of two
+    Ring requests;
+    Ring responses;
+    alignas(64) std::atomic<uint32_t> client_sleeping;
+    alignas(64) std::atomic<uint32_t> server_sleeping;
+};
+
+// Bytes a record with a payload of len bytes takes up in the ring
+uint64_t record_size(uint32_t len)
+{
+    return (4 + (uint64_t)len + 7) & ~7ULL;
+}
+
+// Appends a record if there is room for it and returns whether it did
+bool ring_write(Ring &ring, char *data, uint64_t capacity, const char *payload, uint32_t len, uint32_t flags)
+{
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    uint64_t tail = ring.tail.load(std::memory_order_acquire);
+    uint64_t pos = head & (capacity - 1);
+    uint64_t need = record_size(len);
+    uint64_t pad = capacity - pos < need ? capacity - pos : 0;
+    if (head + pad + need - tail > capacity)
+    {
+        return false;
+    }
+    if (pad != 0)
     {
-        error("Error reading from socket");
+        uint32_t header = RECORD_PAD;
+        memcpy(data + pos, &header, sizeof(header));
+        head += pad;
+        pos = 0;
     }
+    uint32_t header = flags | len;
+    memcpy(data + pos, &header, sizeof(header));
+    memcpy(data + pos + 4, payload, len);
+    ring.head.store(head + need, std::memory_order_release);
+    return true;
+}
 
-    // Allocate a buffer to read the response
-    char *tempBuffer = new char[responseSize + 1];
-    bzero(tempBuffer, responseSize + 1);
+// Finds the record at the tail of the ring, skipping padding. Returns false when
+// the ring is empty; otherwise the payload stays valid until ring_release.
+bool ring_peek(Ring &ring, char *data, uint64_t capacity, uint32_t &header, const char *&payload)
+{
+    uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+    while (tail != ring.head.load(std::memory_order_acquire))
+    {
+        uint64_t pos = tail & (capacity - 1);
+        memcpy(&header, data + pos, sizeof(header));
+        if (header & RECORD_PAD)
+        {
+            tail += capacity - pos;
+            ring.tail.store(tail, std::memory_order_release);
+            continue;
+        }
+        if (4 + (uint64_t)(header & RECORD_LENGTH) > capacity - pos)
+        {
+            std::cerr << "Corrupt shared-memory record" << std::endl;
+            exit(1);
+        }
+        payload = data + pos + 4;
+        return true;
+    }
+    return false;
+}
 
-    // Read the actual response from the server
-    int totalBytesRead = 0;
-    while (totalBytesRead < responseSize)
+void ring_release(Ring &ring, uint32_t header)
+{
+    ring.tail.store(ring.tail.load(std::memory_order_relaxed) + record_size(header & RECORD_LENGTH), std::memory_order_release);
+}
+
+// Wakes the other side if it went to sleep. The fence orders the head/tail
+// store just made before the load of the flag; it pairs with the one in
+// shm_wait, so at least one side sees the other's store.
+void shm_wake(std::atomic<uint32_t> &sleeping, int efd)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load())
     {
-        n = read(sockfd, tempBuffer + totalBytesRead, responseSize - totalBytesRead);
-        if (n < 0)
+        uint64_t one = 1;
+        if (write(efd, &one, sizeof(one)) < 0)
         {
-            error("Error reading from socket");
+            error("Error signalling eventfd");
+        }
+    }
+}
+
+// Calls ready() until it succeeds, spinning at first and then sleeping on efd.
+// The flag is set before ready() is tried one last time, so a wakeup sent in
+// between is never lost. Exits if the server goes away instead.
+template <typename Ready>
+void shm_wait(std::atomic<uint32_t> &sleeping, int efd, int sockfd, Ready ready)
+{
+    for (int i = 0; i < SHM_SPIN; ++i)
+    {
+        if (ready())
+        {
+            return;
         }
-        totalBytesRead += n;
+        sched_yield();
+    }
+    while (1)
+    {
+        sleeping.store(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);  // Publish the flag before re-reading the ring
+        if (ready())
+        {
+            sleeping.store(0);
+            return;
+        }
+        struct pollfd pfds[2];
+        pfds[0].fd = efd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = sockfd;
+        pfds[1].events = POLLIN;
+        if (poll(pfds, 2, -1) < 0 && errno != EINTR)
+        {
+            error("Error waiting on eventfd");
+        }
+        if (pfds[1].revents != 0)
+        {
+            std::cerr << "Server closed the connection" << std::endl;
+            exit(1);
+        }
+        uint64_t count;
+        if ((pfds[0].revents & POLLIN) && read(efd, &count, sizeof(count)) < 0)
+        {
+            error("Error reading eventfd");
+        }
+        sleeping.store(0);
+    }
+}
+
+// Sends every line of standard input through shared memory to the server
+// listening on the Unix socket at path. Requests are answered in order on a
+// single connection, so responses are printed as soon as they arrive.
+void run_shm(const std::string &path, const std::string &options)
+{
+    int sockfd = connect_unix(path);
+    write_fully(sockfd, options.data(), options.size());
+
+    // Create the rings and the eventfds, then hand them to the server
+    uint64_t capacity = SHM_RING_BYTES;
+    size_t size = SHM_HEADER_BYTES + 2 * capacity;
+    int memfd = memfd_create("shannon-rings", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0 || ftruncate(memfd, size) < 0)
+    {
+        error("Error creating shared memory");
+    }
+
+    // Fix the size, so the server can map it without fearing SIGBUS from a later shrink
+    if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+    {
+        error("Error sealing shared memory");
+    }
+    char *base = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (base == MAP_FAILED)
+    {
+        error("Error mapping shared memory");
+    }
+    ShmHeader *shm = new (base) ShmHeader();
+    shm->capacity = capacity;
+    char *requests = base + SHM_HEADER_BYTES;
+    char *responses = requests + capacity;
+    int client_efd = eventfd(0, EFD_CLOEXEC);
+    int server_efd = eventfd(0, EFD_CLOEXEC);
+    if (client_efd < 0 || server_efd < 0)
+    {
+        error("Error creating eventfd");
     }
 
-    // Store the response in the thread data
-    data->response_message = tempBuffer;
-    delete[] tempBuffer;
+    int header = FRAME_SHM;
+    write_fully(sockfd, &header, sizeof(int));
+    int fds[3] = { memfd, client_efd, server_efd };
+    char byte = 0;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(sockfd, &msg, 0) < 0)
+    {
+        error("Error sending shared-memory descriptors");
+    }
+    close(memfd);
+
+    // Prints every response record that has arrived
+    uint32_t max_record = capacity / 2 - 8;
+    size_t pending = 0;  // Requests not fully answered yet
+    auto drain = [&]()
+    {
+        uint32_t record;
+        const char *payload;
+        bool progress = false;
+        while (ring_peek(shm->responses, responses, capacity, record, payload))
+        {
+            std::cout.write(payload, record & RECORD_LENGTH);
+            STATS_ADD(bytes_in, record & RECORD_LENGTH);
+            if (!(record & RECORD_MORE))
+            {
+                pending--;
+            }
+            ring_release(shm->responses, record);
+            progress = true;
+        }
+        if (progress)
+        {
+            shm_wake(shm->server_sleeping, server_efd);
+        }
+    };
+
+    LineReader reader;
+    reader.start = 0;
+    reader.scanned = 0;
+    reader.eof = false;
+    std::string line;
+    while (1)
+    {
+        // Collect the outstanding responses before waiting for more input
+        int rc = next_line(reader, line, 0);
+        if (rc == 0)
+        {
+            shm_wait(shm->client_sleeping, client_efd, sockfd, [&]() { drain(); return pending == 0; });
+            std::cout.flush();
+            rc = next_line(reader, line, -1);
+        }
+        if (rc == -1)
+        {
+            break;
+        }
+        if (line.empty())
+        {
+            continue;
+        }
 
-    // Close the socket
+        // Send the message, draining responses whenever the request ring is full
+        pending++;
+        for (size_t offset = 0; offset < line.size();)
+        {
+            uint32_t len = std::min<size_t>(max_record, line.size() - offset);
+            uint32_t flags = offset + len < line.size() ? RECORD_MORE : 0;
+            shm_wait(shm->client_sleeping, client_efd, sockfd, [&]() { drain(); return ring_write(shm->requests, requests, capacity, line.data() + offset, len, flags); });
+            shm_wake(shm->server_sleeping, server_efd);
+            offset += len;
+        }
+        STATS_ADD(messages, 1);
+        STATS_ADD(requests, 1);
+        STATS_ADD(bytes_out, line.size());
+    }
+    shm_wait(shm->client_sleeping, client_efd, sockfd, [&]() { drain(); return pending == 0; });
+    STATS_DUMP();
     close(sockfd);
+}
+
+// One request on the wire: a single message, a batch or a statistics query
+struct Request
+{
+    std::string input_message;     // The message, or all messages of a batch back to back
+    std::vector<int> offsets;      // Start of each message of a batch (empty for a single message)
+    std::string response_message;
+    bool stats_query;              // Send FRAME_STATS instead of the message
+    int frame;                     // Size or FRAME_* header the request went out with
+    bool done;                     // The whole response has arrived
+};
+
+// Pooled connection to the server. Requests on one connection are answered in
+// the order they were written, so in_flight lists them oldest first.
+struct Connection
+{
+    int fd;
+    bool connecting;               // Non-blocking connect not finished yet
+    uint32_t events;               // Events registered with epoll
+    std::string out;               // Frames not fully written yet, from out_pos
+    size_t out_pos;
+    std::string in;                // Response bytes not parsed yet, from in_pos
+    size_t in_pos;
+    std::deque<Request *> in_flight;
+};
+
+// Connections to one server address, resolved once, driven by one epoll loop
+struct Pool
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int max_connections;
+    int depth;                             // Requests in flight per connection
+    int epfd;
+    std::vector<Connection> connections;   // Reserved up front so pointers stay valid
+    std::string options;                   // Frame every connection starts with, if any
+};
+
+// Resolves the server once and connects to the first address that answers.
+// Returns that connection, which becomes the first one of the pool.
+int resolve_server(Pool &pool, const std::string &hostname, const std::string &port)
+{
+    struct addrinfo hints, *results;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(hostname.c_str(), port.c_str(), &hints, &results);
+    if (rc != 0)
+    {
+        fprintf(stderr, "ERROR, no such host: %s\n", gai_strerror(rc));
+        exit(1);
+    }
+    STATS_LAP(STAGE_RESOLVE);
+
+    int sockfd = -1;
+    for (struct addrinfo *ai = results; ai != NULL && sockfd < 0; ai = ai->ai_next)
+    {
+        sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sockfd < 0)
+        {
+            continue;
+        }
+        if (connect(sockfd, ai->ai_addr, ai->ai_addrlen) < 0)
+        {
+            close(sockfd);
+            sockfd = -1;
+            continue;
+        }
+        memcpy(&pool.addr, ai->ai_addr, ai->ai_addrlen);
+        pool.addr_len = ai->ai_addrlen;
+    }
+    freeaddrinfo(results);
+    if (sockfd < 0)
+    {
+        error("Error connecting");
+    }
+    STATS_LAP(STAGE_CONNECT);
+    return sockfd;
+}
 
-    pthread_exit(NULL);
+// Changes the events epoll reports for a connection
+void watch(Pool &pool, Connection &conn, uint32_t events)
+{
+    if (events != conn.events)
+    {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = &conn;
+        if (epoll_ctl(pool.epfd, EPOLL_CTL_MOD, conn.fd, &ev) < 0)
+        {
+            error("Error updating epoll");
+        }
+        conn.events = events;
+    }
 }
 
-int main(int argc, char *argv[])
+// Adds a connection to the pool, opening a new one unless sockfd is already connected
+Connection &add_connection(Pool &pool, int sockfd)
 {
-    // Check if the correct number of arguments is provided
-    if (argc != 3)
+    bool connecting = false;
+    if (sockfd < 0)
     {
-        std::cerr << "usage " << argv[0] << " hostname port" << std::endl;
-        exit(0);
+        // Unix sockets never finish connecting later (they fail with EAGAIN when
+        // the backlog is full), so only TCP connects in the background
+        bool tcp = pool.addr.ss_family != AF_UNIX;
+        sockfd = socket(pool.addr.ss_family, SOCK_STREAM | (tcp ? SOCK_NONBLOCK : 0), 0);
+        if (sockfd < 0)
+        {
+            error("Error opening socket");
+        }
+        if (connect(sockfd, (struct sockaddr *)&pool.addr, pool.addr_len) < 0)
+        {
+            if (!tcp || errno != EINPROGRESS)
+            {
+                error("Error connecting");
+            }
+            connecting = true;
+        }
+    }
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    if (pool.addr.ss_family != AF_UNIX)
+    {
+        int nodelay = 1;  // Pipelined frames should not wait for the previous one's ACK
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+
+    pool.connections.push_back(Connection());
+    Connection &conn = pool.connections.back();
+    conn.fd = sockfd;
+    conn.connecting = connecting;
+    conn.events = EPOLLIN | (connecting ? (uint32_t)EPOLLOUT : 0);
+    conn.out = pool.options;
+    conn.out_pos = 0;
+    conn.in_pos = 0;
+    struct epoll_event ev;
+    ev.events = conn.events;
+    ev.data.ptr = &conn;
+    if (epoll_ctl(pool.epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0)
+    {
+        error("Error adding to epoll");
+    }
+    return conn;
+}
+
+// Appends the frame for a request to out. Messages larger than one chunk are
+// uploaded in chunks so the server can stream them.
+void encode_request(Request &request, std::string &out)
+{
+    const std::string &message = request.input_message;
+    bool batch = !request.offsets.empty();
+    bool chunked = !request.stats_query && !batch && message.size() > CHUNK_SIZE;
+    request.frame = request.stats_query ? FRAME_STATS : batch ? FRAME_BATCH : chunked ? FRAME_CHUNKED : (int)message.size();
+    out.append((const char *)&request.frame, sizeof(int));
+    if (batch)
+    {
+        int batchHeader[2] = { (int)request.offsets.size(), (int)message.size() };
+        out.append((const char *)batchHeader, sizeof(batchHeader));
+        out.append((const char *)&request.offsets[0], request.offsets.size() * sizeof(int));
+        out.append(message);
+    }
+    else if (chunked)
+    {
+        for (size_t offset = 0; offset < message.size(); offset += CHUNK_SIZE)
+        {
+            int chunkSize = std::min(CHUNK_SIZE, message.size() - offset);
+            out.append((const char *)&chunkSize, sizeof(int));
+            out.append(message, offset, chunkSize);
+        }
+        int terminator = 0;
+        out.append((const char *)&terminator, sizeof(int));
+    }
+    else if (!request.stats_query)
+    {
+        out.append(message);
+    }
+    STATS_ADD(messages, batch ? request.offsets.size() : 1);
+    STATS_ADD(requests, 1);
+    STATS_ADD(bytes_out, sizeof(int) + message.size());
+
+    // Only the frame is needed from now on
+    std::string().swap(request.input_message);
+    std::vector<int>().swap(request.offsets);
+}
+
+// Moves whatever has arrived of the oldest response into its request. Returns
+// true once that response is complete.
+bool parse_response(Connection &conn)
+{
+    Request &request = *conn.in_flight.front();
+    const char *data = conn.in.data() + conn.in_pos;
+    size_t available = conn.in.size() - conn.in_pos;
+    int header[2];
+
+    if (request.frame == FRAME_BATCH)
+    {
+        // The per-message offsets are not needed: the texts are printed back to back
+        if (available < sizeof(header))
+        {
+            return false;
+        }
+        memcpy(header, data, sizeof(header));
+        size_t start = sizeof(header) + header[0] * sizeof(int);
+        if (available < start + header[1])
+        {
+            return false;
+        }
+        request.response_message.assign(data + start, header[1]);
+        conn.in_pos += start + header[1];
+        return true;
+    }
+    if (request.frame == FRAME_CHUNKED)
+    {
+        // A chunked upload is answered with a chunked response
+        while (available >= sizeof(int))
+        {
+            memcpy(header, data, sizeof(int));
+            if (header[0] == 0)
+            {
+                conn.in_pos += sizeof(int);
+                return true;
+            }
+            if (available < sizeof(int) + header[0])
+            {
+                return false;
+            }
+            request.response_message.append(data + sizeof(int), header[0]);
+            conn.in_pos += sizeof(int) + header[0];
+            data += sizeof(int) + header[0];
+            available -= sizeof(int) + header[0];
+        }
+        return false;
+    }
+    if (available < sizeof(int))
+    {
+        return false;
+    }
+    memcpy(header, data, sizeof(int));
+    if (available < sizeof(int) + header[0])
+    {
+        return false;
+    }
+    request.response_message.assign(data + sizeof(int), header[0]);
+    conn.in_pos += sizeof(int) + header[0];
+    return true;
+}
+
+// Reads everything that has arrived on a connection and completes the
+// responses it finishes
+void read_connection(Connection &conn)
+{
+    char chunk[CHUNK_SIZE];
+    while (1)
+    {
+        ssize_t n = read(conn.fd, chunk, sizeof(chunk));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            error("Error reading from socket");
+        }
+        if (n == 0)
+        {
+            std::cerr << "Server closed the connection" << std::endl;
+            exit(1);
+        }
+        conn.in.append(chunk, n);
+        STATS_ADD(bytes_in, n);
+        while (!conn.in_flight.empty() && parse_response(conn))
+        {
+            conn.in_flight.front()->done = true;
+            conn.in_flight.pop_front();
+        }
+
+        // Drop parsed bytes
+        if (conn.in_pos == conn.in.size())
+        {
+            conn.in.clear();
+            conn.in_pos = 0;
+        }
+        else if (conn.in_pos >= CHUNK_SIZE)
+        {
+            conn.in.erase(0, conn.in_pos);
+            conn.in_pos = 0;
+        }
+    }
+}
+
+// Writes as much of the pending frames as the socket takes, and asks epoll to
+// report when it takes more if anything is left
+void flush_connection(Pool &pool, Connection &conn)
+{
+    while (!conn.connecting && conn.out_pos < conn.out.size())
+    {
+        ssize_t n = send(conn.fd, conn.out.data() + conn.out_pos, conn.out.size() - conn.out_pos, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            error("Error writing to socket");
+        }
+        conn.out_pos += n;
+    }
+    if (conn.out_pos == conn.out.size())
+    {
+        conn.out.clear();
+        conn.out_pos = 0;
     }
+    watch(pool, conn, EPOLLIN | (conn.connecting || !conn.out.empty() ? (uint32_t)EPOLLOUT : 0));
+}
+
+// Hands queued requests to connections: an idle one if there is one, else a new
+// one while the pool may grow, else the least busy one below the pipeline depth
+void dispatch(Pool &pool, std::deque<Request *> &queued)
+{
+    while (!queued.empty())
+    {
+        Connection *best = NULL;
+        for (size_t i = 0; i < pool.connections.size(); ++i)
+        {
+            if (best == NULL || pool.connections[i].in_flight.size() < best->in_flight.size())
+            {
+                best = &pool.connections[i];
+            }
+        }
+        if ((best == NULL || !best->in_flight.empty()) && (int)pool.connections.size() < pool.max_connections)
+        {
+            best = &add_connection(pool, -1);
+            STATS_LAP(STAGE_CONNECT);
+        }
+        if (best->in_flight.size() >= (size_t)pool.depth)
+        {
+            break;
+        }
+        encode_request(*queued.front(), best->out);
+        best->in_flight.push_back(queued.front());
+        queued.pop_front();
+        flush_connection(pool, *best);
+    }
+}
+
+// Sends the requests over the pool and prints the responses in their order. With
+// read_input the requests are the lines of standard input, collected into batches
+// until a batch holds BATCH_BYTES of messages or BATCH_DELAY_MS has passed since
+// its first line; otherwise only the requests already given are sent.
+void run_pool(Pool &pool, std::deque<Request> &requests, bool read_input)
+{
+    std::deque<Request *> queued;  // Waiting for room on a connection
+    for (size_t i = 0; i < requests.size(); ++i)
+    {
+        queued.push_back(&requests[i]);
+    }
+
+    // Stop reading input while this many responses are outstanding or unprinted,
+    // so a slow response cannot make the reorder buffer grow without bound
+    size_t window = 2 * (size_t)pool.max_connections * pool.depth;
 
-    std::string hostname = argv[1];  // Get the hostname
-    int portno = atoi(argv[2]);      // Get the port number
+    // Regular files cannot be watched with epoll but are always readable
+    bool input_open = read_input;
+    bool input_polled = false;
+    bool input_armed = false;
+    if (read_input)
+    {
+        struct epoll_event ev;
+        ev.events = 0;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(pool.epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0)
+        {
+            input_polled = true;
+        }
+        else if (errno != EPERM)
+        {
+            error("Error adding stdin to epoll");
+        }
+    }
 
-    // Read input messages from STDIN
-    std::vector<ThreadData> threadDataList;
+    LineReader reader;
+    reader.start = 0;
+    reader.scanned = 0;
+    reader.eof = false;
     std::string line;
-    while (std::getline(std::cin, line))
+    Request *batch = NULL;  // Batch being filled, if any
+    std::chrono::steady_clock::time_point deadline;
+
+    // Queues the batch being filled
+    auto send_batch = [&]()
+    {
+        if (batch->offsets.size() == 1)
+        {
+            batch->offsets.clear(); // A lone message goes out as a plain frame
+        }
+        queued.push_back(batch);
+        batch = NULL;
+    };
+
+    struct epoll_event events[64];
+    dispatch(pool, queued);
+    while (input_open || !requests.empty())
     {
-        if (!line.empty())
+        bool want_input = input_open && requests.size() < window;
+        if (input_polled && want_input != input_armed)
+        {
+            struct epoll_event ev;
+            ev.events = want_input ? (uint32_t)EPOLLIN : 0;
+            ev.data.ptr = NULL;
+            if (epoll_ctl(pool.epfd, EPOLL_CTL_MOD, STDIN_FILENO, &ev) < 0)
+            {
+                error("Error updating epoll");
+            }
+            input_armed = want_input;
+        }
+
+        int timeout = -1;
+        if (want_input && !input_polled)
+        {
+            timeout = 0;
+        }
+        else if (batch != NULL)
+        {
+            long long left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            timeout = left > 0 ? left : 0;
+        }
+        if (timeout != 0)
+        {
+            std::cout.flush();  // About to wait, so show what is done
+        }
+        int n = epoll_wait(pool.epfd, events, 64, timeout);
+        if (n < 0)
         {
-            // Prepare thread data for each input message
-            ThreadData data;
-            data.input_message = line;
-            data.hostname = hostname;
-            data.portno = portno;
-            threadDataList.push_back(data);
+            if (errno != EINTR)
+            {
+                error("Error on epoll_wait");
+            }
+            n = 0;
         }
+        STATS_START();
+
+        bool input_ready = want_input && !input_polled;
+        for (int i = 0; i < n; ++i)
+        {
+            Connection *conn = (Connection *)events[i].data.ptr;
+            if (conn == NULL)
+            {
+                input_ready = true;
+                continue;
+            }
+            if (conn->connecting)
+            {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0)
+                {
+                    errno = err;
+                    error("Error connecting");
+                }
+                conn->connecting = false;
+                STATS_LAP(STAGE_CONNECT);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                read_connection(*conn);
+                STATS_LAP(STAGE_READ);
+            }
+            if (events[i].events & EPOLLOUT)
+            {
+                flush_connection(pool, *conn);
+                STATS_LAP(STAGE_WRITE);
+            }
+        }
+
+        // Turn new input lines into requests; long ones are sent on their own
+        if (input_ready)
+        {
+            fill_line_reader(reader);
+            int rc;
+            while ((rc = take_line(reader, line)) != 0)
+            {
+                bool stale = batch != NULL && std::chrono::steady_clock::now() >= deadline;
+                bool full = batch != NULL && rc == 1 && batch->input_message.size() + line.size() > BATCH_BYTES;
+                if (batch != NULL && (rc == -1 || stale || full))
+                {
+                    send_batch();
+                }
+                if (rc == -1)
+                {
+                    input_open = false;
+                    if (input_polled)
+                    {
+                        epoll_ctl(pool.epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                        input_polled = false;
+                    }
+                    break;
+                }
+                if (line.empty())
+                {
+                    continue;
+                }
+                if (batch == NULL)
+                {
+                    requests.push_back(Request());
+                    batch = &requests.back();
+                    batch->stats_query = false;
+                    batch->done = false;
+                    deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(BATCH_DELAY_MS);
+                }
+                batch->offsets.push_back(batch->input_message.size());
+                batch->input_message += line;
+                if (line.size() >= BATCH_BYTES)
+                {
+                    batch->offsets.clear();
+                    queued.push_back(batch);
+                    batch = NULL;
+                }
+            }
+        }
+        if (batch != NULL && std::chrono::steady_clock::now() >= deadline)
+        {
+            send_batch();
+        }
+
+        dispatch(pool, queued);
+        STATS_LAP(STAGE_WRITE);
+
+        // Print the responses that are next in input order
+        while (!requests.empty() && requests.front().done)
+        {
+            std::cout << requests.front().response_message;
+            requests.pop_front();
+        }
+        STATS_LAP(STAGE_OUTPUT);
     }
+    std::cout.flush();
+}
+
+int main(int argc, char *argv[])
+{
+    const char *program = argv[0];
+    int connections = 8;  // Largest size of the connection pool
+    int depth = 4;        // Requests pipelined on each connection
+    int options[2] = { 0, 0 };
 
-    // Create a thread for each input message
-    std::vector<pthread_t> threads(threadDataList.size());
-    for (size_t i = 0; i < threadDataList.size(); ++i)
+    int opt;
+    while ((opt = getopt(argc, argv, "+c:d:e:r")) != -1)
     {
-        int rc = pthread_create(&threads[i], NULL, client_thread, &threadDataList[i]);
-        if (rc)
+        if (opt == 'c')
+        {
+            connections = std::max(1, atoi(optarg));
+        }
+        else if (opt == 'd')
+        {
+            depth = std::max(1, atoi(optarg));
+        }
+        else if (opt == 'e')
+        {
+            // Code engine by name
+            int count = sizeof(code_engine_names) / sizeof(code_engine_names[0]);
+            for (options[0] = 0; options[0] < count && strcmp(code_engine_names[options[0]], optarg) != 0; ++options[0])
+            {
+            }
+            if (options[0] == count)
+            {
+                std::cerr << "Unknown code engine " << optarg << std::endl;
+                exit(1);
+            }
+        }
+        else if (opt == 'r')
+        {
+            options[1] |= OPTION_REPORT;
+        }
+        else
         {
-            std::cerr << "Error: unable to create thread, " << rc << std::endl;
-            exit(-1);
+            argc = 0;  // Print the usage below
         }
     }
+    argv += optind - 1;
+    argc -= optind - 1;
 
-    // Wait for all threads to finish
-    for (size_t i = 0; i < threads.size(); ++i)
+    // The server is either hostname and port, or unix:<path> or shm:<path> for a
+    // Unix socket on the same machine
+    std::string address = argc > 1 ? argv[1] : "";
+    bool local = address.compare(0, 5, "unix:") == 0 || address.compare(0, 4, "shm:") == 0;
+    bool shm = address.compare(0, 4, "shm:") == 0;
+    int positional = local ? 2 : 3;
+
+    // Check if the correct number of arguments is provided
+    if (argc != positional && !(argc == positional + 1 && std::string(argv[positional]) == "--stats"))
     {
-        pthread_join(threads[i], NULL);
+        std::cerr << "usage " << program << " [-c connections] [-d depth] [-e engine] [-r] {hostname port | unix:path | shm:path} [--stats]" << std::endl;
+        exit(0);
     }
+    bool stats_query = argc == positional + 1;
+    std::string unix_path = local ? address.substr(shm ? 4 : 5) : "";
 
-    // Output the responses received from the server
-    for (size_t i = 0; i < threadDataList.size(); ++i)
+    // Only send options that differ from the server's defaults
+    std::string option_frame;
+    if (options[0] != 0 || options[1] != 0)
     {
-        std::cout << threadDataList[i].response_message;
+        int frame[3] = { FRAME_OPTIONS, options[0], options[1] };
+        option_frame.assign((const char *)frame, sizeof(frame));
     }
 
-    pthread_exit(NULL);
+    STATS_INIT(); // Dump counters on SIGUSR1 (no-op unless built with -DSHANNON_STATS)
+
+    // Shared memory replaces the connection pool entirely
+    if (shm && !stats_query)
+    {
+        run_shm(unix_path, option_frame);
+        return 0;
+    }
+
+    Pool pool;
+    pool.max_connections = stats_query ? 1 : connections;
+    pool.depth = depth;
+    pool.options = stats_query ? "" : option_frame;
+    pool.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (pool.epfd < 0)
+    {
+        error("Error creating epoll");
+    }
+    pool.connections.reserve(pool.max_connections);
+    STATS_START();
+    if (local)
+    {
+        struct sockaddr_un addr;
+        unix_address(unix_path, addr);
+        memcpy(&pool.addr, &addr, sizeof(addr));
+        pool.addr_len = sizeof(addr);
+    }
+    else
+    {
+        add_connection(pool, resolve_server(pool, address, argv[2]));
+    }
+
+    // Statistics query: print the server's counters instead of sending messages
+    std::deque<Request> requests;
+    if (stats_query)
+    {
+        requests.push_back(Request());
+        requests.back().stats_query = true;
+        requests.back().done = false;
+        run_pool(pool, requests, false);
+        return 0;
+    }
+
+    // Read input messages from STDIN and print the responses in the same order
+    run_pool(pool, requests, true);
+    STATS_DUMP();
+
     return 0;
 }
@@ -10,6 +10,9 @@
 #include <stdlib.h>
 #include <string>
 #include <cstring>
+#include <cstdio>
+#include <queue>
+#include <cerrno>
 #include <vector>
 #include <map>
 #include <algorithm>
@@ -21,6 +24,65 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <strings.h>
+#include <pthread.h>
+#include <atomic>
+#include <cstdint>
+#include <poll.h>
+#include <sched.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>  // Vector encode kernels; each is built for its own target and chosen at run time
+#endif
+
+#ifdef SHANNON_STATS
+#include <chrono>
+#include <new>
+#endif
+
+// A msgSize of FRAME_STATS asks for the server's statistics instead of encoding a message
+const int FRAME_STATS = -1;
+
+// A msgSize of FRAME_CHUNKED starts a chunked upload: [int length][bytes] chunks
+// ending with a zero length. The response comes back chunked the same way.
+const int FRAME_CHUNKED = -2;
+
+// A msgSize of FRAME_BATCH carries several messages in one request:
+// [int count][int payloadSize][int offsets[count]][payload], message i being
+// the payload bytes from offsets[i] up to the next offset (or payloadSize).
+// The response has the same layout with each message's response text.
+const int FRAME_BATCH = -3;
+// A batch is held in memory whole, request and response, so its payload may not
+// exceed the spill threshold (at least CHUNK_SIZE) and its response text is capped.
+const int MAX_BATCH_MESSAGES = 64 * 1024;
+const long long MAX_BATCH_RESPONSE_BYTES = 64 << 20;
+
+// A msgSize of FRAME_SHM, sent over the Unix socket, switches the connection to
+// the shared-memory transport: the client passes a memfd holding the two rings
+// and two eventfds (its own, then the server's) with SCM_RIGHTS
+const int FRAME_SHM = -4;
+
+// A msgSize of FRAME_OPTIONS is followed by [int engine][int flags] and applies to
+// the requests after it on the same connection: engine indexes code_engines and
+// OPTION_REPORT adds a bits-per-symbol line to each alphabet. Nothing is sent back.
+const int FRAME_OPTIONS = -5;
+const int OPTION_REPORT = 1;
+
+// Unit in which message bodies are read, encoded and written back
+const size_t CHUNK_SIZE = 64 * 1024;
+
+// Bodies larger than this many bytes are moved from memory to a temporary file
+static size_t spill_threshold = 1 << 20;
+
+// Threads used to encode the messages of one batch
+static int batch_threads = 1;
+
+// Largest message body accepted (-m); a longer upload ends the connection, so no
+// client can fill the spill directory
+static unsigned long long max_body_size = 1ULL << 30;
 
 // Function for error handling
 void error(const char *msg)
@@ -29,21 +91,181 @@ void error(const char *msg)
     exit(1);
 }
 
+#ifdef SHANNON_STATS
+// Instrumentation, only compiled in with -DSHANNON_STATS (the macros below expand
+// to nothing otherwise). The counters live in an anonymous shared mapping created
+// before the first fork, so every child adds into the same totals; each child only
+// touches its own slot, so recording never takes a lock.
+enum Stage { STAGE_READ, STAGE_HISTOGRAM, STAGE_SORT, STAGE_CODES, STAGE_ENCODE, STAGE_FORMAT, STAGE_WRITE, STAGE_COUNT };
+static const char *stage_names[STAGE_COUNT] = { "read", "histogram", "sort", "codes", "encode", "format", "write" };
+
+const int STATS_SLOTS = 64;      // Children share slots by pid (still lock-free)
+const int LATENCY_BUCKETS = 32;  // Bucket b counts requests that took [2^b, 2^(b+1)) microseconds
+
+struct alignas(64) StatsSlot
+{
+    std::atomic<uint64_t> stage_ns[STAGE_COUNT];
+    std::atomic<uint64_t> stage_calls[STAGE_COUNT];
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> messages;  // Batches count one request but many messages
+    std::atomic<uint64_t> bytes_in;
+    std::atomic<uint64_t> bytes_out;
+};
+
+struct ServerStats
+{
+    StatsSlot slots[STATS_SLOTS];
+    std::atomic<uint64_t> latency[LATENCY_BUCKETS];
+    std::atomic<uint64_t> accepted;
+    std::atomic<int64_t> active_children;  // Connections currently being served
+    std::atomic<int64_t> peak_children;
+    std::chrono::steady_clock::time_point started;
+};
+
+static ServerStats *stats_shared = NULL;
+static StatsSlot *stats_slot = NULL;
+static std::chrono::steady_clock::time_point stats_request_start;
+static thread_local std::chrono::steady_clock::time_point stats_lap_start;  // Batches may be encoded by several threads
+
+static void stats_init()
+{
+    void *mem = mmap(NULL, sizeof(ServerStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        error("Error mapping statistics");
+    }
+    stats_shared = new (mem) ServerStats();
+    stats_shared->started = std::chrono::steady_clock::now();
+    stats_slot = &stats_shared->slots[0];
+}
+
+// Called by the parent right before forking a child for a new connection
+static void stats_accepted()
+{
+    stats_shared->accepted.fetch_add(1, std::memory_order_relaxed);
+    int64_t active = stats_shared->active_children.fetch_add(1, std::memory_order_relaxed) + 1;
+    int64_t peak = stats_shared->peak_children.load(std::memory_order_relaxed);
+    while (active > peak && !stats_shared->peak_children.compare_exchange_weak(peak, active, std::memory_order_relaxed));
+}
+
+// Charges the time since the previous lap (or STATS_START) to the given stage
+static void stats_lap(Stage stage)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    stats_slot->stage_ns[stage].fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(now - stats_lap_start).count(), std::memory_order_relaxed);
+    stats_slot->stage_calls[stage].fetch_add(1, std::memory_order_relaxed);
+    stats_lap_start = now;
+}
+
+// Records the latency of the request started by STATS_START
+static void stats_request_done()
+{
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - stats_request_start).count();
+    int bucket = 0;
+    while (bucket + 1 < LATENCY_BUCKETS && (us >> (bucket + 1)) != 0)
+    {
+        ++bucket;
+    }
+    stats_shared->latency[bucket].fetch_add(1, std::memory_order_relaxed);
+    stats_slot->requests.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Formats the current totals as the body of a FRAME_STATS response
+static std::string stats_report()
+{
+    uint64_t ns[STAGE_COUNT] = {0}, calls[STAGE_COUNT] = {0}, requests = 0, messages = 0, bytes_in = 0, bytes_out = 0;
+    for (int i = 0; i < STATS_SLOTS; ++i)
+    {
+        for (int s = 0; s < STAGE_COUNT; ++s)
+        {
+            ns[s] += stats_shared->slots[i].stage_ns[s].load(std::memory_order_relaxed);
+            calls[s] += stats_shared->slots[i].stage_calls[s].load(std::memory_order_relaxed);
+        }
+        requests += stats_shared->slots[i].requests.load(std::memory_order_relaxed);
+        messages += stats_shared->slots[i].messages.load(std::memory_order_relaxed);
+        bytes_in += stats_shared->slots[i].bytes_in.load(std::memory_order_relaxed);
+        bytes_out += stats_shared->slots[i].bytes_out.load(std::memory_order_relaxed);
+    }
+    double uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - stats_shared->started).count();
+
+    char line[256];
+    std::string report;
+    snprintf(line, sizeof(line), "Uptime: %.1f s\nConnections accepted: %llu, active: %lld, peak: %lld\n", uptime,
+             (unsigned long long)stats_shared->accepted.load(std::memory_order_relaxed),
+             (long long)stats_shared->active_children.load(std::memory_order_relaxed),
+             (long long)stats_shared->peak_children.load(std::memory_order_relaxed));
+    report += line;
+    snprintf(line, sizeof(line), "Requests: %llu (%.1f/s), messages: %llu (%.1f/s)\n",
+             (unsigned long long)requests, requests / uptime, (unsigned long long)messages, messages / uptime);
+    report += line;
+    snprintf(line, sizeof(line), "Bytes in: %llu (%.3f MB/s), bytes out: %llu (%.3f MB/s)\n",
+             (unsigned long long)bytes_in, bytes_in / uptime / 1e6,
+             (unsigned long long)bytes_out, bytes_out / uptime / 1e6);
+    report += line;
+    report += "Stages:\n";
+    for (int s = 0; s < STAGE_COUNT; ++s)
+    {
+        snprintf(line, sizeof(line), "  %-10s calls: %-8llu total: %.3f ms, avg: %.3f us\n", stage_names[s],
+                 (unsigned long long)calls[s], ns[s] / 1e6, calls[s] ? ns[s] / 1e3 / calls[s] : 0.0);
+        report += line;
+    }
+    report += "Latency:\n";
+    for (int b = 0; b < LATENCY_BUCKETS; ++b)
+    {
+        uint64_t count = stats_shared->latency[b].load(std::memory_order_relaxed);
+        if (count != 0)
+        {
+            snprintf(line, sizeof(line), "  < %llu us: %llu\n", 2ULL << b, (unsigned long long)count);
+            report += line;
+        }
+    }
+    return report;
+}
+
+#define STATS_INIT() stats_init()
+#define STATS_ACCEPTED() stats_accepted()
+#define STATS_CHILD() (stats_slot = &stats_shared->slots[getpid() % STATS_SLOTS])
+#define STATS_CHILD_REAPED() stats_shared->active_children.fetch_sub(1, std::memory_order_relaxed)
+#define STATS_START() (stats_request_start = stats_lap_start = std::chrono::steady_clock::now())
+#define STATS_THREAD_START() (stats_lap_start = std::chrono::steady_clock::now())
+#define STATS_LAP(stage) stats_lap(stage)
+#define STATS_ADD(counter, n) stats_slot->counter.fetch_add((n), std::memory_order_relaxed)
+#define STATS_REQUEST_DONE() stats_request_done()
+#else
+static std::string stats_report()
+{
+    return "Statistics are not compiled in (rebuild the server with -DSHANNON_STATS)\n";
+}
+
+#define STATS_INIT()
+#define STATS_ACCEPTED()
+#define STATS_CHILD()
+#define STATS_CHILD_REAPED()
+#define STATS_START()
+#define STATS_THREAD_START()
+#define STATS_LAP(stage)
+#define STATS_ADD(counter, n)
+#define STATS_REQUEST_DONE()
+#endif
+
 // Signal handler to prevent zombie processes (reaps child processes)
 void fireman(int)
 {
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+    {
+        STATS_CHILD_REAPED();
+    }
 }
 
 // Comparator function to sort symbols by frequency and ASCII value
-bool custom_comparator(const std::pair<char, int> &a, const std::pair<char, int> &b)
+bool custom_comparator(const std::pair<char, long long> &a, const std::pair<char, long long> &b)
 {
     // Sort by descending frequency, then by descending ASCII value if frequencies are equal
     return a.second > b.second || (a.second == b.second && a.first > b.first);
 }
 
 // Function to calculate Shannon codes for the symbols
-void calculateShannonCodes(const std::vector<std::pair<char, int> > &symbols, int overall_frequency, std::map<char, std::string> &shannon_algorithm)
+void calculateShannonCodes(const std::vector<std::pair<char, long long> > &symbols, long long overall_frequency, std::map<char, std::string> &shannon_algorithm)
 {
     std::vector<double> probabilities(symbols.size(), 0.0);
     double total_probability = 0.0;
@@ -84,194 +306,1573 @@ void calculateShannonCodes(const std::vector<std::pair<char, int> > &symbols, in
     }
 }
 
-// Function to perform Shannon coding on the input message
-void shannon_coding(const std::string &input, std::map<char, std::string> &shannon_algorithm, std::string &encoded_string, std::vector<std::pair<char, int> > &sorted_symbols)
+// Turns code lengths into canonical codes, shortest codes first and symbols of
+// equal length in their sorted order
+void assignCanonicalCodes(const std::vector<std::pair<char, long long> > &symbols, const std::vector<int> &lengths, std::map<char, std::string> &codes)
 {
-    std::map<char, int> frequency;
-
-    // Calculate the frequency of each character in the input
-    for (size_t i = 0; i < input.size(); ++i)
+    std::vector<size_t> order(symbols.size());
+    for (size_t i = 0; i < order.size(); ++i)
     {
-        char ch = input[i];
-        frequency[ch]++;
+        order[i] = i;
     }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return lengths[a] < lengths[b]; });
 
-    // Create a vector of symbols and their frequencies
-    sorted_symbols.assign(frequency.begin(), frequency.end());
+    std::string code = "";  // Next unused code
+    for (size_t k = 0; k < order.size(); ++k)
+    {
+        size_t i = order[k];
+        code.append(lengths[i] - code.size(), '0');
+        codes[symbols[i].first] = code;
 
-    // Sort the symbols based on frequency and ASCII value
-    std::sort(sorted_symbols.begin(), sorted_symbols.end(), custom_comparator);
+        // Add one to the code
+        for (size_t b = code.size(); b-- > 0; )
+        {
+            code[b] = code[b] == '0' ? '1' : '0';
+            if (code[b] == '1')
+            {
+                break;
+            }
+        }
+    }
+}
 
-    // Total frequency is the length of the input
-    int overall_frequency = input.length();
+// Function to calculate Huffman codes for the symbols
+void calculateHuffmanCodes(const std::vector<std::pair<char, long long> > &symbols, long long overall_frequency, std::map<char, std::string> &codes)
+{
+    (void)overall_frequency;
+    size_t n = symbols.size();
+    if (n <= 1)
+    {
+        if (n == 1)
+        {
+            codes[symbols[0].first] = "0";  // A lone symbol still needs one bit
+        }
+        return;
+    }
 
-    // Generate Shannon codes for the symbols
-    calculateShannonCodes(sorted_symbols, overall_frequency, shannon_algorithm);
+    // Merge the two lightest nodes until only the root is left (nodes below n are symbols)
+    std::priority_queue<std::pair<long long, size_t>, std::vector<std::pair<long long, size_t> >, std::greater<std::pair<long long, size_t> > > heap;
+    std::vector<size_t> parent(2 * n, 0);
+    for (size_t i = 0; i < n; ++i)
+    {
+        heap.push(std::make_pair(symbols[i].second, i));
+    }
+    for (size_t node = n; heap.size() > 1; ++node)
+    {
+        std::pair<long long, size_t> a = heap.top(); heap.pop();
+        std::pair<long long, size_t> b = heap.top(); heap.pop();
+        parent[a.second] = parent[b.second] = node;
+        heap.push(std::make_pair(a.first + b.first, node));
+    }
 
-    // Encode the message using the Shannon codes
-    std::stringstream encoded_stream;
-    for (size_t i = 0; i < input.size(); ++i)
+    // Each code is as long as its symbol is deep; the root is the last node
+    size_t root = 2 * n - 2;
+    std::vector<int> lengths(n, 0);
+    for (size_t i = 0; i < n; ++i)
     {
-        char ch = input[i];
-        encoded_stream << shannon_algorithm[ch];
+        for (size_t node = i; node != root; node = parent[node])
+        {
+            lengths[i]++;
+        }
     }
-    encoded_string = encoded_stream.str();
+    assignCanonicalCodes(symbols, lengths, codes);
 }
 
-int main(int argc, char *argv[])
+// Function to calculate optimal codes of at most max_length bits for the symbols
+// (package-merge: a symbol's code length is the number of times it is part of the
+// 2n - 2 cheapest items after max_length - 1 rounds of pairing and merging)
+void calculateLengthLimitedCodes(const std::vector<std::pair<char, long long> > &symbols, int max_length, std::map<char, std::string> &codes)
 {
-    int sockfd, newsockfd, portno;
-    socklen_t clilen;
-    struct sockaddr_in serv_addr, cli_addr;
-
-    // Check if port number is provided
-    if (argc != 2)
+    size_t n = symbols.size();
+    if (n <= 1)
     {
-        std::cerr << "Port not provided" << std::endl;
-        exit(1);
+        if (n == 1)
+        {
+            codes[symbols[0].first] = "0";  // A lone symbol still needs one bit
+        }
+        return;
+    }
+    while ((1ULL << max_length) < n)
+    {
+        max_length++;  // Not enough codes of that length
     }
 
-    // Create a socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)
+    // Symbols first, least frequent first, then the packages as they are made
+    struct Item
     {
-        error("Error opening socket");
+        long long weight;
+        size_t left, right; // Packed items (unused for symbols)
+    };
+    std::vector<Item> items;
+    for (size_t k = 0; k < n; ++k)
+    {
+        items.push_back(Item{symbols[n - 1 - k].second, 0, 0});
     }
-    
-    // Set socket options to reuse the address
-    int opt = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(opt)) < 0)
+    std::vector<size_t> round(n);
+    for (size_t k = 0; k < n; ++k)
     {
-        error("Error setting SO_REUSEADDR");
+        round[k] = k;
+    }
+    for (int level = 1; level < max_length; ++level)
+    {
+        std::vector<size_t> merged;
+        size_t leaf = 0;
+        for (size_t k = 0; k + 1 < round.size(); k += 2)
+        {
+            items.push_back(Item{items[round[k]].weight + items[round[k + 1]].weight, round[k], round[k + 1]});
+            while (leaf < n && items[leaf].weight <= items.back().weight)
+            {
+                merged.push_back(leaf++);
+            }
+            merged.push_back(items.size() - 1);
+        }
+        while (leaf < n)
+        {
+            merged.push_back(leaf++);
+        }
+        round = merged;
     }
-        
-
-    // Initialize server address structure
-    bzero((char *)&serv_addr, sizeof(serv_addr));
-    portno = atoi(argv[1]);  // Get port number from arguments
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;  // Accept connections from any IP
-    serv_addr.sin_port = htons(portno);
 
-    // Bind the socket to the address
-    if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    // Count the uses of each symbol
+    std::vector<int> lengths(n, 0);
+    std::vector<size_t> pending(round.begin(), round.begin() + 2 * n - 2);
+    while (!pending.empty())
     {
-        error("Error on binding");
+        size_t item = pending.back();
+        pending.pop_back();
+        if (item < n)
+        {
+            lengths[n - 1 - item]++;
+        }
+        else
+        {
+            pending.push_back(items[item].left);
+            pending.push_back(items[item].right);
+        }
     }
+    assignCanonicalCodes(symbols, lengths, codes);
+}
 
-    // Listen for incoming connections
-    listen(sockfd, 5);
-    clilen = sizeof(cli_addr);
+// Fixed limits for the engine table
+void calculateLimited12Codes(const std::vector<std::pair<char, long long> > &symbols, long long overall_frequency, std::map<char, std::string> &codes)
+{
+    (void)overall_frequency;
+    calculateLengthLimitedCodes(symbols, 12, codes);
+}
 
-    // Handle zombie child processes
-    signal(SIGCHLD, fireman);
+void calculateLimited15Codes(const std::vector<std::pair<char, long long> > &symbols, long long overall_frequency, std::map<char, std::string> &codes)
+{
+    (void)overall_frequency;
+    calculateLengthLimitedCodes(symbols, 15, codes);
+}
 
-    while (1)
+// Code constructions a client can pick per connection with FRAME_OPTIONS (by index)
+struct CodeEngine
+{
+    const char *label;  // Printed in front of each code in the alphabet
+    void (*build)(const std::vector<std::pair<char, long long> > &symbols, long long overall_frequency, std::map<char, std::string> &codes);
+};
+
+static const CodeEngine code_engines[] = {
+    { "Shannon code", calculateShannonCodes },
+    { "Huffman code", calculateHuffmanCodes },
+    { "Length-limited code", calculateLimited12Codes },
+    { "Length-limited code", calculateLimited15Codes },
+};
+const int CODE_ENGINES = sizeof(code_engines) / sizeof(code_engines[0]);
+
+// Options of the connection this child serves, changed by FRAME_OPTIONS
+static const CodeEngine *code_engine = &code_engines[0];
+static bool report_efficiency = false;
+
+// Reads exactly len bytes from the socket; exits the child if the client goes away
+void read_fully(int sockfd, void *buffer, size_t len)
+{
+    size_t totalBytesRead = 0;
+    while (totalBytesRead < len)
     {
-        // Accept a new connection
-        newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
-        if (newsockfd < 0)
+        ssize_t n = read(sockfd, (char *)buffer + totalBytesRead, len - totalBytesRead);
+        if (n < 0)
         {
-            error("Error on accept");
+            error("Error reading from socket");
         }
+        if (n == 0)
+        {
+            std::cerr << "Client closed the connection mid-message" << std::endl;
+            exit(1);
+        }
+        totalBytesRead += n;
+    }
+}
+
+// Reads the size of the next message. Returns false if the client closed the
+// connection cleanly between messages instead.
+bool read_frame_header(int sockfd, int &msgSize)
+{
+    ssize_t n;
+    while ((n = read(sockfd, &msgSize, sizeof(int))) < 0 && errno == EINTR)
+    {
+    }
+    if (n < 0)
+    {
+        error("Error reading from socket");
+    }
+    if (n == 0)
+    {
+        return false;
+    }
+    read_fully(sockfd, (char *)&msgSize + n, sizeof(int) - n);
+    return true;
+}
 
-        // Fork a child process to handle the client
-        pid_t pid = fork();
-        if (pid < 0)
+// Writes exactly len bytes to the socket
+void write_fully(int sockfd, const void *buffer, size_t len)
+{
+    size_t totalBytesWritten = 0;
+    while (totalBytesWritten < len)
+    {
+        ssize_t n = write(sockfd, (const char *)buffer + totalBytesWritten, len - totalBytesWritten);
+        if (n < 0)
         {
-            error("Error on fork");
+            error("Error writing to socket");
         }
-        if (pid == 0)
+        totalBytesWritten += n;
+    }
+}
+
+// Message body received from the client. It stays in memory up to spill_threshold
+// bytes and moves to an unlinked temporary file past that, so a connection never
+// holds more than spill_threshold + CHUNK_SIZE bytes of payload. The histogram is
+// built as the chunks arrive.
+struct MessageBody
+{
+    std::string memory;     // Contents while the body is small
+    const char *view;       // Contents owned by someone else (a batch request), or NULL
+    int spill_fd;           // Temporary file holding the contents, or -1
+    long long size;         // Bytes received so far
+    long long counts[256];  // Frequency of each byte value
+};
+
+void body_init(MessageBody &body)
+{
+    body.memory.clear();
+    body.view = NULL;
+    body.spill_fd = -1;
+    body.size = 0;
+    memset(body.counts, 0, sizeof(body.counts));
+}
+
+// Counts and stores one chunk of the message
+void body_append(MessageBody &body, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        body.counts[(unsigned char)data[i]]++;
+    }
+    STATS_LAP(STAGE_HISTOGRAM);
+
+    if (body.size + len > max_body_size)
+    {
+        std::cerr << "Message body exceeds the " << max_body_size << " byte limit" << std::endl;
+        exit(1);
+    }
+    if (body.spill_fd < 0 && body.memory.size() + len > spill_threshold)
+    {
+        // Move what we have so far to a temporary file that disappears on close
+        const char *tmpdir = getenv("TMPDIR");
+        std::string path = std::string(tmpdir ? tmpdir : "/tmp") + "/shannon-upload-XXXXXX";
+        std::vector<char> name(path.begin(), path.end());
+        name.push_back('\0');
+        body.spill_fd = mkstemp(&name[0]);
+        if (body.spill_fd < 0)
         {
-            // Child process
-            close(sockfd);  // Close the listening socket in the child
+            error("Error creating spill file");
+        }
+        unlink(&name[0]);
+        write_fully(body.spill_fd, body.memory.data(), body.memory.size());
+        std::string().swap(body.memory);
+    }
+    if (body.spill_fd >= 0)
+    {
+        write_fully(body.spill_fd, data, len);
+    }
+    else
+    {
+        body.memory.append(data, len);
+    }
+    body.size += len;
+}
 
-            int n, msgSize = 0;
+// Counts a message that is already in memory without copying it
+void body_init_view(MessageBody &body, const char *data, size_t len)
+{
+    body_init(body);
+    for (size_t i = 0; i < len; ++i)
+    {
+        body.counts[(unsigned char)data[i]]++;
+    }
+    STATS_LAP(STAGE_HISTOGRAM);
+    body.view = data;
+    body.size = len;
+}
 
-            // Read the size of the incoming message
-            n = read(newsockfd, &msgSize, sizeof(int));
-            if (n < 0)
-            {
-                error("Error reading from socket");
-            }
+// Returns up to CHUNK_SIZE bytes of the body starting at offset and sets len to
+// how many there are (0 at the end). A spilled body is read into scratch first.
+const char *body_chunk(const MessageBody &body, long long offset, std::vector<char> &scratch, size_t &len)
+{
+    len = 0;
+    if (offset >= body.size)
+    {
+        return NULL;
+    }
+    len = body.size - offset < (long long)CHUNK_SIZE ? body.size - offset : CHUNK_SIZE;
+    if (body.view != NULL)
+    {
+        return body.view + offset;
+    }
+    if (body.spill_fd < 0)
+    {
+        return body.memory.data() + offset;
+    }
+    scratch.resize(CHUNK_SIZE);
+    size_t total = 0;
+    while (total < len)
+    {
+        ssize_t n = pread(body.spill_fd, &scratch[total], len - total, offset + total);
+        if (n <= 0)
+        {
+            error("Error reading spill file");
+        }
+        total += n;
+    }
+    return &scratch[0];
+}
 
-            // Allocate buffer and read the actual message
-            int totalBytesRead = 0;
-            char *tempBuffer = new char[msgSize + 1];
-            bzero(tempBuffer, msgSize + 1);
-            while (totalBytesRead < msgSize)
+void body_close(MessageBody &body)
+{
+    if (body.spill_fd >= 0)
+    {
+        close(body.spill_fd);
+    }
+    body_init(body);
+}
+
+// Reads a message body from the socket. A sized frame carries msgSize bytes; a
+// chunked frame carries [int length][bytes] chunks ending with a zero length.
+void read_body(int sockfd, int msgSize, MessageBody &body)
+{
+    std::vector<char> chunk(CHUNK_SIZE);
+    body_init(body);
+    if (msgSize == FRAME_CHUNKED)
+    {
+        while (1)
+        {
+            int chunkSize = 0;
+            read_fully(sockfd, &chunkSize, sizeof(int));
+            if (chunkSize == 0)
             {
-                n = read(newsockfd, tempBuffer + totalBytesRead, msgSize - totalBytesRead);
-                if (n < 0)
-                {
-                    error("Error reading from socket");
-                }
-                totalBytesRead += n;
+                break;
             }
-            std::string input_message = tempBuffer;
-            delete[] tempBuffer;
-
-            // Perform Shannon coding on the input message
-            std::map<char, std::string> shannon_algorithm;
-            std::string encoded_string;
-            std::vector<std::pair<char, int> > sorted_symbols;
-            shannon_coding(input_message, shannon_algorithm, encoded_string, sorted_symbols);
-
-            // Prepare the response to send back to the client
-            std::stringstream response_stream;
-            response_stream << "Message: " << input_message << std::endl
-                            << std::endl;
-            response_stream << "Alphabet:" << std::endl;
-
-            // Add each symbol's details to the response
-            for (size_t i = 0; i < sorted_symbols.size(); ++i)
+            if (chunkSize < 0 || chunkSize > (int)CHUNK_SIZE)
             {
-                char ch = sorted_symbols[i].first;
-                int freq = sorted_symbols[i].second;
-                response_stream << "Symbol: " << ch
-                                << ", Frequency: " << freq
-                                << ", Shannon code: " << shannon_algorithm[ch] << std::endl;
+                std::cerr << "Invalid chunk size " << chunkSize << std::endl;
+                exit(1);
             }
-            response_stream << std::endl;
-            response_stream << "Encoded message: " << encoded_string << std::endl
-                            << std::endl;
+            read_fully(sockfd, &chunk[0], chunkSize);
+            STATS_LAP(STAGE_READ);
+            body_append(body, &chunk[0], chunkSize);
+        }
+    }
+    else
+    {
+        if ((unsigned long long)msgSize > max_body_size)
+        {
+            std::cerr << "Message body exceeds the " << max_body_size << " byte limit" << std::endl;
+            exit(1);
+        }
+        long long remaining = msgSize;
+        while (remaining > 0)
+        {
+            size_t len = remaining < (long long)CHUNK_SIZE ? remaining : CHUNK_SIZE;
+            read_fully(sockfd, &chunk[0], len);
+            STATS_LAP(STAGE_READ);
+            body_append(body, &chunk[0], len);
+            remaining -= len;
+        }
+    }
+}
+
+// Function to perform Shannon coding on a message whose histogram was built while it was read
+void shannon_coding(const MessageBody &body, std::map<char, std::string> &shannon_algorithm, std::vector<std::pair<char, long long> > &sorted_symbols)
+{
+    // Create a vector of the symbols that occur and their frequencies
+    sorted_symbols.clear();
+    for (int c = 0; c < 256; ++c)
+    {
+        if (body.counts[c] != 0)
+        {
+            sorted_symbols.push_back(std::make_pair((char)c, body.counts[c]));
+        }
+    }
 
-            std::string response = response_stream.str();
-            int responseSize = response.size();
+    // Sort the symbols based on frequency and ASCII value
+    std::sort(sorted_symbols.begin(), sorted_symbols.end(), custom_comparator);
+    STATS_LAP(STAGE_SORT);
 
-            // Send the size of the response first
-            n = write(newsockfd, &responseSize, sizeof(int));
-            if (n < 0)
-            {
-                error("Error writing to socket");
-            }
+    // Generate codes for the symbols with the connection's engine; the total frequency is the length of the input
+    code_engine->build(sorted_symbols, body.size, shannon_algorithm);
+    STATS_LAP(STAGE_CODES);
+}
 
-            // Send the actual response
-            int totalBytesWritten = 0;
-            while (totalBytesWritten < responseSize)
-            {
-                n = write(newsockfd, response.c_str() + totalBytesWritten, responseSize - totalBytesWritten);
-                if (n < 0)
-                {
-                    error("Error writing to socket");
-                }
-                totalBytesWritten += n;
-            }
+// The encoded message is written through two steps: the codes of a block of
+// input are packed as bit fields into 64-bit words (first code bit lowest), and
+// the words are expanded into '0'/'1' characters. The AVX2 and AVX-512 variants
+// gather 8 or 16 codes per step and compute their bit offsets with a prefix sum,
+// so no character has to wait for the length of the one before it.
+struct PackedCodes
+{
+    uint32_t code[256];   // Bits of each code, first bit lowest
+    uint32_t length[256]; // Number of bits (32-bit so the vector kernels can gather it)
+    bool fits;            // No code is longer than 32 bits, else encode_symbols appends strings
+};
 
-            // Close the connection and exit the child process
-            close(newsockfd);
-            exit(0);
+const size_t ENCODE_BLOCK = 4096; // Input bytes per pack/expand round
+const size_t ENCODE_WORDS = ENCODE_BLOCK / 2 + 2; // Up to 32 bits per byte, plus a word of overflow
+
+void pack_codes(const std::string codes[256], PackedCodes &packed)
+{
+    packed.fits = true;
+    for (int c = 0; c < 256; ++c)
+    {
+        const std::string &code = codes[c];
+        packed.code[c] = 0;
+        packed.length[c] = code.size();
+        if (code.size() > 32)
+        {
+            packed.fits = false;
+            continue;
         }
-        else
+        for (size_t b = 0; b < code.size(); ++b)
         {
-            // Parent process closes the connected socket and continues listening
-            close(newsockfd);
+            packed.code[c] |= (uint32_t)(code[b] == '1') << b;
         }
     }
+}
 
-    // Close the listening socket 
-    close(sockfd);
-    return 0;
+// ORs bits (at most 64) into the words starting at bit offset
+static inline void put_bits(uint64_t *words, size_t offset, uint64_t bits)
+{
+    size_t shift = offset & 63;
+    words[offset >> 6] |= bits << shift;
+    if (shift != 0)
+    {
+        words[(offset >> 6) + 1] |= bits >> (64 - shift);
+    }
+}
+
+// Packs the codes of n characters into zeroed words and returns the number of bits
+size_t pack_scalar(const PackedCodes &packed, const unsigned char *input, size_t n, uint64_t *words)
+{
+    size_t bits = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        put_bits(words, bits, packed.code[input[i]]);
+        bits += packed.length[input[i]];
+    }
+    return bits;
+}
+
+// Writes one character per packed bit, from bit `from` up to `bits`
+void expand_scalar(const uint64_t *words, size_t from, size_t bits, char *output)
+{
+    for (size_t b = from; b < bits; ++b)
+    {
+        output[b] = '0' + ((words[b >> 6] >> (b & 63)) & 1);
+    }
 }
 
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("avx2")))
+size_t pack_avx2(const PackedCodes &packed, const unsigned char *input, size_t n, uint64_t *words)
+{
+    const __m256i low = _mm256_set1_epi64x(0xffffffff);
+    const __m256i zero = _mm256_setzero_si256();
+    alignas(32) uint64_t pairs[4], starts[4];
+    size_t bits = 0, i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(input + i)));
+        __m256i code = _mm256_i32gather_epi32((const int*)packed.code, index, 4);
+        __m256i length = _mm256_i32gather_epi32((const int*)packed.length, index, 4);
+
+        // Merge each pair of neighbours: the second code goes right after the first
+        __m256i first_length = _mm256_and_si256(length, low);
+        __m256i pair = _mm256_or_si256(_mm256_and_si256(code, low), _mm256_sllv_epi64(_mm256_srli_epi64(code, 32), first_length));
+        __m256i pair_length = _mm256_add_epi64(first_length, _mm256_srli_epi64(length, 32));
+
+        // Inclusive prefix sum of the four pair lengths gives where each pair ends
+        __m256i end = pair_length;
+        end = _mm256_add_epi64(end, _mm256_blend_epi32(_mm256_permute4x64_epi64(end, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x03));
+        end = _mm256_add_epi64(end, _mm256_blend_epi32(_mm256_permute4x64_epi64(end, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x0F));
+        __m256i start = _mm256_add_epi64(_mm256_sub_epi64(end, pair_length), _mm256_set1_epi64x(bits));
+
+        _mm256_store_si256((__m256i*)pairs, pair);
+        _mm256_store_si256((__m256i*)starts, start);
+        for (int k = 0; k < 4; ++k)
+        {
+            put_bits(words, starts[k], pairs[k]);
+        }
+        bits += _mm256_extract_epi64(end, 3);
+    }
+    for (; i < n; ++i)
+    {
+        put_bits(words, bits, packed.code[input[i]]);
+        bits += packed.length[input[i]];
+    }
+    return bits;
+}
 
+__attribute__((target("avx2")))
+void expand_avx2(const uint64_t *words, size_t bits, char *output)
+{
+    // Byte k of a 32-bit group goes to output bytes 8k..8k+7, one bit each
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i select = _mm256_set1_epi64x(0x8040201008040201LL);
+    const __m256i zeros = _mm256_set1_epi8('0');
+    size_t b = 0;
+    for (; b + 32 <= bits; b += 32)
+    {
+        uint32_t group = words[b / 64] >> (b & 63);
+        __m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32(group), spread);
+        __m256i set = _mm256_cmpeq_epi8(_mm256_and_si256(bytes, select), select);
+        _mm256_storeu_si256((__m256i*)(output + b), _mm256_sub_epi8(zeros, set));
+    }
+    expand_scalar(words, b, bits, output);
+}
+
+__attribute__((target("avx512f,bmi2")))
+size_t pack_avx512(const PackedCodes &packed, const unsigned char *input, size_t n, uint64_t *words)
+{
+    const __m512i low = _mm512_set1_epi64(0xffffffff);
+    const __m512i zero = _mm512_setzero_si512();
+    alignas(64) uint64_t pairs[8], starts[8], ends[8];
+    size_t bits = 0, i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        // Full-mask variants of cvtepu8/gather/shift/alignr; GCC 12 warns about the
+        // undefined passthrough of the unmasked ones
+        __m512i index = _mm512_maskz_cvtepu8_epi32((__mmask16)-1, _mm_loadu_si128((const __m128i*)(input + i)));
+        __m512i code = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), (__mmask16)-1, index, (const int*)packed.code, 4);
+        __m512i length = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), (__mmask16)-1, index, (const int*)packed.length, 4);
+
+        // Merge each pair of neighbours: the second code goes right after the first
+        __m512i first_length = _mm512_and_si512(length, low);
+        __m512i pair = _mm512_or_si512(_mm512_and_si512(code, low), _mm512_maskz_sllv_epi64((__mmask8)-1, _mm512_maskz_srli_epi64((__mmask8)-1, code, 32), first_length));
+        __m512i pair_length = _mm512_add_epi64(first_length, _mm512_maskz_srli_epi64((__mmask8)-1, length, 32));
+
+        // Inclusive prefix sum over the eight lanes, shifting in zeros by 1, 2 and 4 lanes
+        __m512i end = pair_length;
+        end = _mm512_add_epi64(end, _mm512_maskz_alignr_epi64((__mmask8)-1, end, zero, 7));
+        end = _mm512_add_epi64(end, _mm512_maskz_alignr_epi64((__mmask8)-1, end, zero, 6));
+        end = _mm512_add_epi64(end, _mm512_maskz_alignr_epi64((__mmask8)-1, end, zero, 4));
+        __m512i start = _mm512_add_epi64(_mm512_sub_epi64(end, pair_length), _mm512_set1_epi64(bits));
+
+        _mm512_store_si512(pairs, pair);
+        _mm512_store_si512(starts, start);
+        _mm512_store_si512(ends, end);
+        for (int k = 0; k < 8; ++k)
+        {
+            put_bits(words, starts[k], pairs[k]);
+        }
+        bits += ends[7];
+    }
+    for (; i < n; ++i)
+    {
+        put_bits(words, bits, packed.code[input[i]]);
+        bits += packed.length[input[i]];
+    }
+    return bits;
+}
+
+__attribute__((target("avx512f,bmi2")))
+void expand_avx512(const uint64_t *words, size_t bits, char *output)
+{
+    // PDEP spreads eight bits over the lowest bit of eight bytes
+    size_t b = 0;
+    for (; b + 8 <= bits; b += 8)
+    {
+        uint64_t chars = _pdep_u64((words[b / 64] >> (b & 63)) & 0xff, 0x0101010101010101ULL) | 0x3030303030303030ULL;
+        memcpy(output + b, &chars, 8);
+    }
+    expand_scalar(words, b, bits, output);
+}
+#endif
+
+// Kernels in use, chosen on first use from what the CPU supports; the
+// SHANNON_KERNEL environment variable (scalar, avx2, avx512) can pin one
+struct EncodeKernel
+{
+    const char *name;
+    size_t (*pack)(const PackedCodes &packed, const unsigned char *input, size_t n, uint64_t *words);
+    void (*expand)(const uint64_t *words, size_t bits, char *output);
+};
+
+void expand_all_scalar(const uint64_t *words, size_t bits, char *output)
+{
+    expand_scalar(words, 0, bits, output);
+}
+
+const EncodeKernel &encode_kernel()
+{
+    static const EncodeKernel kernel = []()
+    {
+        std::vector<EncodeKernel> kernels;
+#if defined(__GNUC__) && defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("bmi2"))
+        {
+            kernels.push_back(EncodeKernel{"avx512", pack_avx512, expand_avx512});
+        }
+        if (__builtin_cpu_supports("avx2"))
+        {
+            kernels.push_back(EncodeKernel{"avx2", pack_avx2, expand_avx2});
+        }
+#endif
+        kernels.push_back(EncodeKernel{"scalar", pack_scalar, expand_all_scalar});
+        const char *wanted = getenv("SHANNON_KERNEL");
+        for (const auto &kernel : kernels)
+        {
+            if (wanted != NULL && strcmp(kernel.name, wanted) == 0)
+            {
+                return kernel;
+            }
+        }
+        return kernels.front();
+    }();
+    return kernel;
+}
+
+// Appends the encoding of n input bytes to output
+void encode_symbols(const std::string codes[256], const PackedCodes &packed, const char *input, size_t n, std::string &output)
+{
+    if (!packed.fits)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            output += codes[(unsigned char)input[i]];
+        }
+        return;
+    }
+    const EncodeKernel &kernel = encode_kernel();
+    static thread_local std::vector<uint64_t> words(ENCODE_WORDS);
+    for (size_t done = 0; done < n; done += ENCODE_BLOCK)
+    {
+        size_t count = std::min(ENCODE_BLOCK, n - done);
+        std::fill(words.begin(), words.begin() + count / 2 + 2, 0);
+        size_t bits = kernel.pack(packed, (const unsigned char*)input + done, count, words.data());
+        size_t old_size = output.size();
+        output.resize(old_size + bits);
+        kernel.expand(words.data(), bits, &output[old_size]);
+    }
+}
+
+// How a response reaches the client: as one sized frame, as a chunked frame,
+// as records in a shared-memory ring, or collected in memory to become part of
+// a batch response
+enum ResponseMode { RESPONSE_SIZED, RESPONSE_CHUNKED, RESPONSE_RING, RESPONSE_MEMORY };
+
+struct ShmSession;
+void shm_send(ShmSession &session, const char *data, size_t len, bool last);
+
+// Buffers response bytes and writes them out CHUNK_SIZE at a time. A sized
+// response has its total length written before the first chunk; a chunked one
+// prefixes every chunk with its length and ends with a zero length; a ring
+// response goes out as RECORD_MORE records and ends with a record without the
+// flag. In memory mode nothing is written and the buffer just keeps growing.
+struct ResponseWriter
+{
+    int sockfd;
+    ResponseMode mode;
+    std::string buffer;
+    long long written;
+    ShmSession *shm;  // RESPONSE_RING only
+};
+
+void response_flush(ResponseWriter &out)
+{
+    if (out.buffer.empty() || out.mode == RESPONSE_MEMORY)
+    {
+        return;
+    }
+    if (out.mode == RESPONSE_RING)
+    {
+        shm_send(*out.shm, out.buffer.data(), out.buffer.size(), false);
+    }
+    else
+    {
+        if (out.mode == RESPONSE_CHUNKED)
+        {
+            int chunkSize = out.buffer.size();
+            write_fully(out.sockfd, &chunkSize, sizeof(int));
+        }
+        write_fully(out.sockfd, out.buffer.data(), out.buffer.size());
+    }
+    out.written += out.buffer.size();
+    out.buffer.clear();
+    STATS_LAP(STAGE_WRITE);
+}
+
+void response_append(ResponseWriter &out, const char *data, size_t len)
+{
+    out.buffer.append(data, len);
+    if (out.buffer.size() >= CHUNK_SIZE)
+    {
+        response_flush(out);
+    }
+}
+
+void response_finish(ResponseWriter &out)
+{
+    if (out.mode == RESPONSE_RING)
+    {
+        // The rest goes in the closing record, even if there is nothing left
+        shm_send(*out.shm, out.buffer.data(), out.buffer.size(), true);
+        out.written += out.buffer.size();
+        out.buffer.clear();
+        STATS_LAP(STAGE_WRITE);
+        return;
+    }
+    response_flush(out);
+    if (out.mode == RESPONSE_CHUNKED)
+    {
+        int terminator = 0;
+        write_fully(out.sockfd, &terminator, sizeof(int));
+    }
+}
+
+// Encodes the body and streams the response; unless the writer is in memory
+// mode only one chunk of input and one of output are held at a time
+void encode_response(ResponseWriter &out, const MessageBody &body, const std::map<char, std::string> &shannon_algorithm, const std::vector<std::pair<char, long long> > &sorted_symbols)
+{
+    // Lookup table of the codes, indexed by byte value
+    std::string codes[256];
+    long long encoded_bits = 0;
+    for (std::map<char, std::string>::const_iterator it = shannon_algorithm.begin(); it != shannon_algorithm.end(); ++it)
+    {
+        codes[(unsigned char)it->first] = it->second;
+        encoded_bits += body.counts[(unsigned char)it->first] * (long long)it->second.size();
+    }
+    PackedCodes packed;
+    pack_codes(codes, packed);
+
+    // Everything between the echoed message and the encoded message
+    std::stringstream alphabet_stream;
+    alphabet_stream << std::endl
+                    << std::endl;
+    alphabet_stream << "Alphabet:" << std::endl;
+    for (size_t i = 0; i < sorted_symbols.size(); ++i)
+    {
+        char ch = sorted_symbols[i].first;
+        long long freq = sorted_symbols[i].second;
+        alphabet_stream << "Symbol: " << ch
+                        << ", Frequency: " << freq
+                        << ", " << code_engine->label << ": " << codes[(unsigned char)ch] << std::endl;
+    }
+    if (report_efficiency && body.size > 0)
+    {
+        // How close the codes come to the entropy of the message
+        double entropy = 0.0;
+        for (size_t i = 0; i < sorted_symbols.size(); ++i)
+        {
+            double p = (double)sorted_symbols[i].second / body.size;
+            entropy -= p * log2(p);
+        }
+        char line[96];
+        snprintf(line, sizeof(line), "Bits per symbol: %.3f, entropy: %.3f", (double)encoded_bits / body.size, entropy);
+        alphabet_stream << line << std::endl;
+    }
+    alphabet_stream << std::endl;
+    alphabet_stream << "Encoded message: ";
+    std::string alphabet = alphabet_stream.str();
+    const std::string message_label = "Message: ";
+    const std::string trailer = "\n\n";
+    STATS_LAP(STAGE_FORMAT);
+
+    if (out.mode == RESPONSE_SIZED)
+    {
+        // Sized frames announce the whole length before any of it is produced
+        long long total = message_label.size() + body.size + alphabet.size() + encoded_bits + trailer.size();
+        if (total > 0x7fffffffLL)
+        {
+            std::cerr << "Response too large for a sized frame, use a chunked upload" << std::endl;
+            exit(1);
+        }
+        int responseSize = (int)total;
+        write_fully(out.sockfd, &responseSize, sizeof(int));
+    }
+
+    std::vector<char> scratch;
+    const char *chunk;
+    size_t len;
+
+    // Echo the message back
+    response_append(out, message_label.data(), message_label.size());
+    for (long long offset = 0; (chunk = body_chunk(body, offset, scratch, len)) != NULL; offset += len)
+    {
+        response_append(out, chunk, len);
+    }
+    response_append(out, alphabet.data(), alphabet.size());
+
+    // Encode the message using the codes
+    STATS_LAP(STAGE_WRITE);
+    for (long long offset = 0; (chunk = body_chunk(body, offset, scratch, len)) != NULL; offset += len)
+    {
+        encode_symbols(codes, packed, chunk, len, out.buffer);
+        STATS_LAP(STAGE_ENCODE);
+        if (out.buffer.size() >= CHUNK_SIZE)
+        {
+            response_flush(out);
+        }
+    }
+    response_append(out, trailer.data(), trailer.size());
+    response_finish(out);
+    STATS_ADD(bytes_out, out.written);
+    STATS_ADD(messages, 1);
+}
+
+// Messages of a batch encoded by one thread, in order, into a single buffer
+struct BatchRange
+{
+    const char *payload;
+    const int *offsets;
+    int payloadSize;
+    int count;
+    int begin, end;             // Messages [begin, end) of the batch
+    ResponseWriter out;         // Memory mode: the concatenated response texts
+    std::vector<int> lengths;   // Length of each message's response text
+    std::atomic<long long> *reserved;  // Response bytes claimed by all ranges so far
+};
+
+void *encode_batch_range(void *arg)
+{
+    BatchRange *range = (BatchRange *)arg;
+    STATS_THREAD_START();
+    for (int i = range->begin; i < range->end; ++i)
+    {
+        int start = range->offsets[i];
+        int stop = i + 1 < range->count ? range->offsets[i + 1] : range->payloadSize;
+        size_t before = range->out.buffer.size();
+
+        MessageBody body;
+        body_init_view(body, range->payload + start, stop - start);
+        std::map<char, std::string> shannon_algorithm;
+        std::vector<std::pair<char, long long> > sorted_symbols;
+        shannon_coding(body, shannon_algorithm, sorted_symbols);
+
+        // Claim an upper bound of the response text before building it: the echo,
+        // the encoded bits and a generous line per symbol of the alphabet
+        long long bound = body.size + 128 * (long long)(sorted_symbols.size() + 4);
+        for (std::map<char, std::string>::const_iterator it = shannon_algorithm.begin(); it != shannon_algorithm.end(); ++it)
+        {
+            bound += body.counts[(unsigned char)it->first] * (long long)it->second.size();
+        }
+        if ((*range->reserved += bound) > MAX_BATCH_RESPONSE_BYTES)
+        {
+            std::cerr << "Batch response exceeds " << MAX_BATCH_RESPONSE_BYTES << " bytes" << std::endl;
+            exit(1);
+        }
+        encode_response(range->out, body, shannon_algorithm, sorted_symbols);
+        range->lengths.push_back(range->out.buffer.size() - before);
+    }
+    return NULL;
+}
+
+// Reads a FRAME_BATCH request into a single buffer, encodes every message
+// (spread over batch_threads threads) and sends back one batch response
+void handle_batch(int sockfd)
+{
+    int header[2];  // count, payloadSize
+    read_fully(sockfd, header, sizeof(header));
+    int count = header[0], payloadSize = header[1];
+    long long max_payload = std::max(spill_threshold, CHUNK_SIZE);
+    if (count <= 0 || count > MAX_BATCH_MESSAGES || payloadSize < 0 || payloadSize > max_payload)
+    {
+        std::cerr << "Invalid batch of " << count << " messages, " << payloadSize << " bytes" << std::endl;
+        exit(1);
+    }
+
+    // Offsets and payload arrive back to back, so one allocation holds the whole request
+    std::vector<char> request(count * sizeof(int) + payloadSize);
+    read_fully(sockfd, &request[0], request.size());
+    const int *offsets = (const int *)&request[0];
+    const char *payload = &request[count * sizeof(int)];
+    for (int i = 0; i < count; ++i)
+    {
+        int stop = i + 1 < count ? offsets[i + 1] : payloadSize;
+        if (offsets[i] < 0 || offsets[i] > stop)
+        {
+            std::cerr << "Invalid offset in batch" << std::endl;
+            exit(1);
+        }
+    }
+    STATS_LAP(STAGE_READ);
+    STATS_ADD(bytes_in, payloadSize);
+
+    // Split the messages into contiguous ranges holding about the same number of bytes
+    int threads = std::min(batch_threads, count);
+    std::vector<BatchRange> ranges(threads);
+    std::atomic<long long> reserved(0);
+    int begin = 0;
+    for (int t = 0; t < threads; ++t)
+    {
+        long long target = (long long)payloadSize * (t + 1) / threads;
+        int end = begin + 1;
+        while (end < count && (t == threads - 1 || offsets[end] < target) && count - end > threads - 1 - t)
+        {
+            ++end;
+        }
+        BatchRange &range = ranges[t];
+        range.payload = payload;
+        range.offsets = offsets;
+        range.payloadSize = payloadSize;
+        range.count = count;
+        range.begin = begin;
+        range.end = end;
+        range.out.sockfd = -1;
+        range.out.mode = RESPONSE_MEMORY;
+        range.out.written = 0;
+        range.out.shm = NULL;
+        range.reserved = &reserved;
+        begin = end;
+    }
+    std::vector<pthread_t> tids(threads);
+    for (int t = 1; t < threads; ++t)
+    {
+        if (pthread_create(&tids[t], NULL, encode_batch_range, &ranges[t]) != 0)
+        {
+            error("Error creating batch thread");
+        }
+    }
+    encode_batch_range(&ranges[0]);
+    for (int t = 1; t < threads; ++t)
+    {
+        pthread_join(tids[t], NULL);
+    }
+
+    // Response header, then the texts of each range in order
+    std::vector<int> response_header(2 + count);
+    long long total = 0;
+    int i = 0;
+    for (int t = 0; t < threads; ++t)
+    {
+        for (size_t k = 0; k < ranges[t].lengths.size(); ++k)
+        {
+            response_header[2 + i++] = (int)total;
+            total += ranges[t].lengths[k];
+        }
+    }
+    response_header[0] = count;
+    response_header[1] = (int)total;
+    write_fully(sockfd, &response_header[0], response_header.size() * sizeof(int));
+    for (int t = 0; t < threads; ++t)
+    {
+        write_fully(sockfd, ranges[t].out.buffer.data(), ranges[t].out.buffer.size());
+    }
+    STATS_LAP(STAGE_WRITE);
+    STATS_ADD(bytes_out, response_header.size() * sizeof(int) + total);
+}
+
+// Sends a response frame: the size of the response followed by the response itself
+void send_response(int sockfd, const std::string &response)
+{
+    int responseSize = response.size();
+    write_fully(sockfd, &responseSize, sizeof(int));
+    write_fully(sockfd, response.c_str(), responseSize);
+}
+
+// Shared-memory transport. The mapping starts with a ShmHeader page followed by
+// two single-producer rings of capacity bytes each: requests (client to server)
+// and responses (server to client). A ring holds records of a 4-byte header
+// (length and flags) and the payload, padded to 8 bytes. A record never wraps:
+// when it would not fit before the end, the producer writes a RECORD_PAD header
+// and starts again at offset 0, so the server can encode a request in place.
+// Messages or responses larger than half a ring are sent as several records,
+// all but the last flagged RECORD_MORE. Each side spins briefly when it has
+// nothing to do, then sets its sleeping flag and blocks on its eventfd; the
+// other side only writes to that eventfd when the flag is set.
+const uint32_t RECORD_MORE = 0x80000000u;
+const uint32_t RECORD_PAD = 0x40000000u;
+const uint32_t RECORD_LENGTH = 0x3fffffffu;
+const size_t SHM_HEADER_BYTES = 4096;
+const int SHM_SPIN = 64;
+
+struct Ring
+{
+    alignas(64) std::atomic<uint64_t> head;  // Bytes published by the producer so far
+    alignas(64) std::atomic<uint64_t> tail;  // Bytes released by the consumer so far
+};
+
+struct ShmHeader
+{
+    uint64_t capacity;  // Data bytes in each ring, a power of two
+    Ring requests;
+    Ring responses;
+    alignas(64) std::atomic<uint32_t> client_sleeping;
+    alignas(64) std::atomic<uint32_t> server_sleeping;
+};
+
+// Bytes a record with a payload of len bytes takes up in the ring
+uint64_t record_size(uint32_t len)
+{
+    return (4 + (uint64_t)len + 7) & ~7ULL;
+}
+
+// Appends a record if there is room for it and returns whether it did
+bool ring_write(Ring &ring, char *data, uint64_t capacity, const char *payload, uint32_t len, uint32_t flags)
+{
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    uint64_t tail = ring.tail.load(std::memory_order_acquire);
+    uint64_t pos = head & (capacity - 1);
+    uint64_t need = record_size(len);
+    uint64_t pad = capacity - pos < need ? capacity - pos : 0;
+    if (head + pad + need - tail > capacity)
+    {
+        return false;
+    }
+    if (pad != 0)
+    {
+        uint32_t header = RECORD_PAD;
+        memcpy(data + pos, &header, sizeof(header));
+        head += pad;
+        pos = 0;
+    }
+    uint32_t header = flags | len;
+    memcpy(data + pos, &header, sizeof(header));
+    memcpy(data + pos + 4, payload, len);
+    ring.head.store(head + need, std::memory_order_release);
+    return true;
+}
+
+// Finds the record at the tail of the ring, skipping padding. Returns false when
+// the ring is empty; otherwise the payload stays valid until ring_release.
+bool ring_peek(Ring &ring, char *data, uint64_t capacity, uint32_t &header, const char *&payload)
+{
+    uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+    while (tail != ring.head.load(std::memory_order_acquire))
+    {
+        uint64_t pos = tail & (capacity - 1);
+        memcpy(&header, data + pos, sizeof(header));
+        if (header & RECORD_PAD)
+        {
+            tail += capacity - pos;
+            ring.tail.store(tail, std::memory_order_release);
+            continue;
+        }
+        if (4 + (uint64_t)(header & RECORD_LENGTH) > capacity - pos)
+        {
+            std::cerr << "Corrupt shared-memory record" << std::endl;
+            exit(1);
+        }
+        payload = data + pos + 4;
+        return true;
+    }
+    return false;
+}
+
+void ring_release(Ring &ring, uint32_t header)
+{
+    ring.tail.store(ring.tail.load(std::memory_order_relaxed) + record_size(header & RECORD_LENGTH), std::memory_order_release);
+}
+
+// Wakes the other side if it went to sleep. The fence orders the head/tail
+// store just made before the load of the flag; it pairs with the one in
+// shm_wait, so at least one side sees the other's store.
+void shm_wake(std::atomic<uint32_t> &sleeping, int efd)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load())
+    {
+        uint64_t one = 1;
+        if (write(efd, &one, sizeof(one)) < 0)
+        {
+            error("Error signalling eventfd");
+        }
+    }
+}
+
+// Calls ready() until it succeeds, spinning at first and then sleeping on efd.
+// The flag is set before ready() is tried one last time, so a wakeup sent in
+// between is never lost. Returns false if the client hung up on sockfd instead.
+template <typename Ready>
+bool shm_wait(std::atomic<uint32_t> &sleeping, int efd, int sockfd, Ready ready)
+{
+    for (int i = 0; i < SHM_SPIN; ++i)
+    {
+        if (ready())
+        {
+            return true;
+        }
+        sched_yield();
+    }
+    while (1)
+    {
+        sleeping.store(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);  // Publish the flag before re-reading the ring
+        if (ready())
+        {
+            sleeping.store(0);
+            return true;
+        }
+        struct pollfd pfds[2];
+        pfds[0].fd = efd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = sockfd;
+        pfds[1].events = POLLIN;
+        if (poll(pfds, 2, -1) < 0 && errno != EINTR)
+        {
+            error("Error waiting on eventfd");
+        }
+        if (pfds[1].revents != 0)
+        {
+            return false;  // The client never sends anything else, so this is a hang-up
+        }
+        uint64_t count;
+        if ((pfds[0].revents & POLLIN) && read(efd, &count, sizeof(count)) < 0)
+        {
+            error("Error reading eventfd");
+        }
+        sleeping.store(0);
+    }
+}
+
+// The mapped rings of one shared-memory connection
+struct ShmSession
+{
+    ShmHeader *shm;
+    char *responses;
+    uint64_t capacity;
+    uint32_t max_record;
+    int sockfd, client_efd, server_efd;
+};
+
+// Writes response bytes into the ring as records of at most max_record bytes,
+// waiting for the client to make room. Only the final record of the last call
+// of a response (last) goes without RECORD_MORE.
+void shm_send(ShmSession &session, const char *data, size_t len, bool last)
+{
+    size_t offset = 0;
+    do
+    {
+        uint32_t part = std::min<size_t>(session.max_record, len - offset);
+        uint32_t flags = last && offset + part == len ? 0 : RECORD_MORE;
+        if (!shm_wait(session.shm->server_sleeping, session.server_efd, session.sockfd, [&]() { return ring_write(session.shm->responses, session.responses, session.capacity, data + offset, part, flags); }))
+        {
+            exit(0);
+        }
+        shm_wake(session.shm->client_sleeping, session.client_efd);
+        offset += part;
+    } while (offset < len);
+}
+
+// Serves requests from the shared-memory rings until the client closes its socket
+void serve_shm(int sockfd)
+{
+    // Receive the memfd and the two eventfds
+    int fds[3];
+    char byte;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    if (recvmsg(sockfd, &msg, 0) <= 0)
+    {
+        error("Error receiving shared-memory descriptors");
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    {
+        std::cerr << "Shared-memory setup without descriptors" << std::endl;
+        exit(1);
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    int client_efd = fds[1], server_efd = fds[2];
+
+    // Only a memfd sealed against shrinking is mapped: if the client could cut it
+    // short later, touching the rings would kill this process with SIGBUS
+    int seals = fcntl(fds[0], F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK))
+    {
+        std::cerr << "Shared memory is not sealed against shrinking" << std::endl;
+        exit(1);
+    }
+
+    // Map the rings, checking the size the client claims against the memfd
+    struct stat st;
+    if (fstat(fds[0], &st) < 0 || st.st_size < (off_t)SHM_HEADER_BYTES)
+    {
+        error("Error checking shared memory");
+    }
+    char *base = (char *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (base == MAP_FAILED)
+    {
+        error("Error mapping shared memory");
+    }
+    close(fds[0]);
+    ShmHeader *shm = (ShmHeader *)base;
+    uint64_t capacity = shm->capacity;
+    if (capacity < 4096 || (capacity & (capacity - 1)) != 0 || SHM_HEADER_BYTES + 2 * capacity != (uint64_t)st.st_size)
+    {
+        std::cerr << "Invalid shared-memory ring size" << std::endl;
+        exit(1);
+    }
+    char *requests = base + SHM_HEADER_BYTES;
+    ShmSession session;
+    session.shm = shm;
+    session.responses = requests + capacity;
+    session.capacity = capacity;
+    session.max_record = capacity / 2 - 8;
+    session.sockfd = sockfd;
+    session.client_efd = client_efd;
+    session.server_efd = server_efd;
+
+    while (1)
+    {
+        uint32_t header = 0;
+        const char *payload = NULL;
+        if (!shm_wait(shm->server_sleeping, server_efd, sockfd, [&]() { return ring_peek(shm->requests, requests, capacity, header, payload); }))
+        {
+            break;
+        }
+        STATS_START();
+
+        // A single-record message is encoded where it lies; a fragmented one is
+        // collected record by record, spilling to disk if it is large
+        MessageBody body;
+        bool in_place = !(header & RECORD_MORE);
+        if (in_place)
+        {
+            body_init_view(body, payload, header & RECORD_LENGTH);
+        }
+        else
+        {
+            body_init(body);
+            while (1)
+            {
+                body_append(body, payload, header & RECORD_LENGTH);
+                bool more = header & RECORD_MORE;
+                ring_release(shm->requests, header);
+                shm_wake(shm->client_sleeping, client_efd);
+                if (!more)
+                {
+                    break;
+                }
+                if (!shm_wait(shm->server_sleeping, server_efd, sockfd, [&]() { return ring_peek(shm->requests, requests, capacity, header, payload); }))
+                {
+                    exit(0);
+                }
+            }
+        }
+        STATS_ADD(bytes_in, body.size);
+
+        std::map<char, std::string> shannon_algorithm;
+        std::vector<std::pair<char, long long> > sorted_symbols;
+        shannon_coding(body, shannon_algorithm, sorted_symbols);
+        // The response is streamed into the other ring while it is produced, so
+        // only one chunk of it is held here
+        ResponseWriter out;
+        out.sockfd = -1;
+        out.mode = RESPONSE_RING;
+        out.written = 0;
+        out.shm = &session;
+        encode_response(out, body, shannon_algorithm, sorted_symbols);
+        body_close(body);
+        if (in_place)
+        {
+            ring_release(shm->requests, header);
+            shm_wake(shm->client_sleeping, client_efd);
+        }
+        STATS_REQUEST_DONE();
+    }
+}
+
+// Answers one request whose size has just been read. Returns false when the
+// connection cannot carry further requests.
+bool handle_request(int newsockfd, int msgSize)
+{
+    // Statistics query: answer with the current totals instead of encoding
+    if (msgSize == FRAME_STATS)
+    {
+        send_response(newsockfd, stats_report());
+        return true;
+    }
+
+    // Batch of messages: one request, one response
+    if (msgSize == FRAME_BATCH)
+    {
+        handle_batch(newsockfd);
+        STATS_REQUEST_DONE();
+        return true;
+    }
+
+    // Options for the requests that follow
+    if (msgSize == FRAME_OPTIONS)
+    {
+        int options[2];
+        read_fully(newsockfd, options, sizeof(options));
+        if (options[0] < 0 || options[0] >= CODE_ENGINES)
+        {
+            std::cerr << "Invalid code engine " << options[0] << std::endl;
+            exit(1);
+        }
+        code_engine = &code_engines[options[0]];
+        report_efficiency = options[1] & OPTION_REPORT;
+        return true;
+    }
+
+    // Shared-memory session: the socket only carries the setup and the hang-up
+    if (msgSize == FRAME_SHM)
+    {
+        serve_shm(newsockfd);
+        return false;
+    }
+    if (msgSize < 0 && msgSize != FRAME_CHUNKED)
+    {
+        std::cerr << "Invalid message size " << msgSize << std::endl;
+        exit(1);
+    }
+
+    // Read the message in chunks, building the histogram as it arrives
+    MessageBody body;
+    read_body(newsockfd, msgSize, body);
+    STATS_ADD(bytes_in, body.size);
+
+    // Perform Shannon coding on the input message
+    std::map<char, std::string> shannon_algorithm;
+    std::vector<std::pair<char, long long> > sorted_symbols;
+    shannon_coding(body, shannon_algorithm, sorted_symbols);
+
+    // Stream the response back to the client
+    ResponseWriter out;
+    out.sockfd = newsockfd;
+    out.mode = msgSize == FRAME_CHUNKED ? RESPONSE_CHUNKED : RESPONSE_SIZED;
+    out.written = 0;
+    out.shm = NULL;
+    encode_response(out, body, shannon_algorithm, sorted_symbols);
+    body_close(body);
+    STATS_REQUEST_DONE();
+    return true;
+}
+
+// Child process: answers requests on one connection, in order, until the client
+// closes it. Clients may send the next request before reading a response.
+void handle_connection(int newsockfd)
+{
+    int msgSize = 0;
+    while (read_frame_header(newsockfd, msgSize))
+    {
+        STATS_START();
+        if (!handle_request(newsockfd, msgSize))
+        {
+            break;
+        }
+    }
+}
+
+// Parses a whole decimal number in [min, max] from a command-line argument
+bool parse_number(const char *text, unsigned long long min, unsigned long long max, unsigned long long &value)
+{
+    char *end;
+    errno = 0;
+    value = strtoull(text, &end, 10);
+    return errno == 0 && end != text && *end == '\0' && text[0] != '-' && value >= min && value <= max;
+}
+
+int main(int argc, char *argv[])
+{
+    int sockfd, unixfd = -1, newsockfd, portno;
+    struct sockaddr_in serv_addr;
+    const char *unix_path = NULL;
+    const char *program = argv[0];
+
+    // Optional Unix socket for co-located clients and body size limit, then the positional arguments
+    int opt;
+    bool valid = true;
+    unsigned long long value = 0;
+    while ((opt = getopt(argc, argv, "u:m:")) != -1)
+    {
+        if (opt == 'u')
+        {
+            unix_path = optarg;
+        }
+        else if (opt == 'm' && parse_number(optarg, 1, 1ULL << 62, value))
+        {
+            max_body_size = value;
+        }
+        else
+        {
+            valid = false;  // Print the usage below
+        }
+    }
+    argv += optind - 1;
+    argc -= optind - 1;
+
+    // Check if port number is provided and every number is well formed
+    valid = valid && argc >= 2 && argc <= 4 && parse_number(argv[1], 1, 65535, value);
+    portno = value;
+    if (valid && argc >= 3)
+    {
+        valid = parse_number(argv[2], 0, (size_t)-1, value);
+        spill_threshold = value;
+    }
+    if (valid && argc >= 4)
+    {
+        valid = parse_number(argv[3], 1, 1024, value);
+        batch_threads = value;
+    }
+    if (!valid)
+    {
+        std::cerr << "usage " << program << " [-u unix_socket_path] [-m max_body_bytes] port [spill_threshold_bytes [batch_threads]]" << std::endl;
+        exit(1);
+    }
+
+    // Create a socket
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0)
+    {
+        error("Error opening socket");
+    }
+    
+    // Set socket options to reuse the address
+    int reuse = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (char *)&reuse, sizeof(reuse)) < 0)
+    {
+        error("Error setting SO_REUSEADDR");
+    }
+        
+
+    // Initialize server address structure
+    bzero((char *)&serv_addr, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;  // Accept connections from any IP
+    serv_addr.sin_port = htons(portno);
+
+    // Bind the socket to the address
+    if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    {
+        error("Error on binding");
+    }
+
+    // Listen for incoming connections
+    listen(sockfd, 5);
+
+    // Same protocol over a Unix socket, which also carries shared-memory setups
+    if (unix_path != NULL)
+    {
+        struct sockaddr_un unix_addr;
+        if (strlen(unix_path) >= sizeof(unix_addr.sun_path))
+        {
+            std::cerr << "Unix socket path too long" << std::endl;
+            exit(1);
+        }
+        unixfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (unixfd < 0)
+        {
+            error("Error opening Unix socket");
+        }
+        bzero((char *)&unix_addr, sizeof(unix_addr));
+        unix_addr.sun_family = AF_UNIX;
+        strcpy(unix_addr.sun_path, unix_path);
+        unlink(unix_path);  // Left over from a previous run
+        if (bind(unixfd, (struct sockaddr *)&unix_addr, sizeof(unix_addr)) < 0)
+        {
+            error("Error binding Unix socket");
+        }
+        listen(unixfd, 5);
+    }
+
+    // Handle zombie child processes
+    signal(SIGCHLD, fireman);
+
+    // Shared counters for FRAME_STATS queries (no-op unless built with -DSHANNON_STATS)
+    STATS_INIT();
+
+    struct pollfd listeners[2];
+    listeners[0].fd = sockfd;
+    listeners[0].events = POLLIN;
+    listeners[1].fd = unixfd;  // Ignored by poll when -1
+    listeners[1].events = POLLIN;
+
+    while (1)
+    {
+        // Wait for a connection on either socket
+        if (poll(listeners, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;  // SIGCHLD
+            }
+            error("Error on poll");
+        }
+        for (int l = 0; l < 2; ++l)
+        {
+            if (!(listeners[l].revents & POLLIN))
+            {
+                continue;
+            }
+
+            // Accept a new connection
+            newsockfd = accept(listeners[l].fd, NULL, NULL);
+            if (newsockfd < 0)
+            {
+                error("Error on accept");
+            }
+
+            // Fork a child process to handle the client
+            STATS_ACCEPTED();
+            pid_t pid = fork();
+            if (pid < 0)
+            {
+                error("Error on fork");
+            }
+            if (pid == 0)
+            {
+                // Child process
+                close(sockfd);  // Close the listening sockets in the child
+                if (unixfd >= 0)
+                {
+                    close(unixfd);
+                }
+                STATS_CHILD();
+                handle_connection(newsockfd);
+
+                // Close the connection and exit the child process
+                close(newsockfd);
+                exit(0);
+            }
+            else
+            {
+                // Parent process closes the connected socket and continues listening
+                close(newsockfd);
+            }
+        }
+    }
+
+    // Close the listening sockets 
+    close(sockfd);
+    if (unixfd >= 0)
+    {
+        close(unixfd);
+    }
+    return 0;
+}
@@ -6,32 +6,148 @@
 #include <vector>
 #include <algorithm>
 #include <string>
-#include <sstream>
 #include <cmath>
 #include <pthread.h>
 #include <semaphore.h> 
+#include <deque>
+#include <atomic>
+#include <cstdlib>
+#include <unistd.h>
+#include <cstdint>
+#include <queue>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+
+#ifdef SHANNON_STATS
+#include <chrono>
+#include <csignal>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h> // AVX2 / AVX-512 encode kernels, compiled per function and picked at run time
+#endif
 
 using namespace std;
 
+#ifdef SHANNON_STATS
+// Instrumentation, only compiled in with -DSHANNON_STATS (the macros below expand
+// to nothing otherwise). Every thread claims a counter slot once and then only
+// touches its own slot, so recording never takes a lock.
+enum Stage { STAGE_HISTOGRAM, STAGE_SORT, STAGE_CODES, STAGE_ENCODE, STAGE_PRINT_WAIT, STAGE_OUTPUT, STAGE_COUNT };
+static const char* stage_names[STAGE_COUNT] = { "histogram", "sort", "codes", "encode", "print wait", "output" };
+
+const int STATS_SLOTS = 64; // Threads past this share slots round-robin (still lock-free)
+
+struct alignas(64) StatsSlot
+{
+    atomic<uint64_t> stage_ns[STAGE_COUNT];
+    atomic<uint64_t> stage_calls[STAGE_COUNT];
+    atomic<uint64_t> messages;
+    atomic<uint64_t> bytes_in;
+    atomic<uint64_t> bits_out;
+    atomic<uint64_t> tasks;
+    atomic<uint64_t> steals;
+};
+
+static StatsSlot stats_slots[STATS_SLOTS];
+static atomic<unsigned> stats_next_slot(0);
+static thread_local StatsSlot* stats_slot = nullptr;
+static thread_local chrono::steady_clock::time_point stats_lap_start;
+
+static StatsSlot& stats_local()
+{
+    if (stats_slot == nullptr)
+    {
+        stats_slot = &stats_slots[stats_next_slot.fetch_add(1, memory_order_relaxed) % STATS_SLOTS];
+    }
+    return *stats_slot;
+}
+
+// Charges the time since the previous lap (or STATS_START) to the given stage
+static void stats_lap(Stage stage)
+{
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    StatsSlot& slot = stats_local();
+    slot.stage_ns[stage].fetch_add(chrono::duration_cast<chrono::nanoseconds>(now - stats_lap_start).count(), memory_order_relaxed);
+    slot.stage_calls[stage].fetch_add(1, memory_order_relaxed);
+    stats_lap_start = now;
+}
+
+// Sums every slot and prints the totals to stderr
+static void stats_dump()
+{
+    uint64_t ns[STAGE_COUNT] = {0}, calls[STAGE_COUNT] = {0}, messages = 0, bytes_in = 0, bits_out = 0, tasks = 0, steals = 0;
+    for (int i = 0; i < STATS_SLOTS; ++i)
+    {
+        for (int s = 0; s < STAGE_COUNT; ++s)
+        {
+            ns[s] += stats_slots[i].stage_ns[s].load(memory_order_relaxed);
+            calls[s] += stats_slots[i].stage_calls[s].load(memory_order_relaxed);
+        }
+        messages += stats_slots[i].messages.load(memory_order_relaxed);
+        bytes_in += stats_slots[i].bytes_in.load(memory_order_relaxed);
+        bits_out += stats_slots[i].bits_out.load(memory_order_relaxed);
+        tasks += stats_slots[i].tasks.load(memory_order_relaxed);
+        steals += stats_slots[i].steals.load(memory_order_relaxed);
+    }
+    fprintf(stderr, "[stats] messages: %llu, bytes in: %llu, bits out: %llu, tasks: %llu, steals: %llu\n",
+            (unsigned long long)messages, (unsigned long long)bytes_in, (unsigned long long)bits_out,
+            (unsigned long long)tasks, (unsigned long long)steals);
+    for (int s = 0; s < STAGE_COUNT; ++s)
+    {
+        fprintf(stderr, "[stats] %-10s calls: %-8llu total: %.3f ms, avg: %.3f us\n", stage_names[s],
+                (unsigned long long)calls[s], ns[s] / 1e6, calls[s] ? ns[s] / 1e3 / calls[s] : 0.0);
+    }
+}
+
+// Dumps the counters each time SIGUSR1 arrives; SIGUSR1 is blocked in every
+// other thread so the dump runs here instead of inside a signal handler
+static void* stats_signal_thread(void* arg)
+{
+    sigset_t* set = static_cast<sigset_t*>(arg);
+    int sig;
+    while (sigwait(set, &sig) == 0)
+    {
+        stats_dump();
+    }
+    return nullptr;
+}
+
+static void stats_init()
+{
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr); // Inherited by every thread created afterwards
+    pthread_t tid;
+    pthread_create(&tid, nullptr, stats_signal_thread, &set);
+    pthread_detach(tid);
+}
+
+#define STATS_INIT() stats_init()
+#define STATS_DUMP() stats_dump()
+#define STATS_START() (stats_lap_start = chrono::steady_clock::now())
+#define STATS_LAP(stage) stats_lap(stage)
+#define STATS_ADD(counter, n) stats_local().counter.fetch_add((n), memory_order_relaxed)
+#else
+#define STATS_INIT()
+#define STATS_DUMP()
+#define STATS_START()
+#define STATS_LAP(stage)
+#define STATS_ADD(counter, n)
+#endif
+
 
 // Struct to store the result for each message
 struct EncodedResult 
 {
     string message;
-    map<char, string> shannon_algorithm; // Shannon codes for each character
+    map<char, string> shannon_algorithm; // Codes for each character (from the selected engine)
     string encoded_string;
     map<char, int> frequency; // Frequency of each character
     vector<pair<char, int>> sorted_symbols; // Symbols sorted by frequency and ASCII
-};
-
-// Struct to hold shared data and synchronization primitives
-struct ThreadData {
-    pthread_mutex_t bsem;           // Mutex for shared data access
-    sem_t* print_sems;              // Array of semaphores for printing in order
-    int id;                         // Thread ID
-    string message;                 // Message to process
-    sem_t copy_sem;                 // Semaphore to synchronize copying of data
-    int total_threads;              // Total number of threads
+    int id; // Position of the message in the input
 };
 
 // Comparator to sort symbols by frequency and ASCII value
@@ -79,9 +195,482 @@ void calculateShannonCodes(const vector<pair<char, int>>& symbols, int overall_f
     }
 }
 
+// Assigns canonical codes from the code lengths (shortest first, ties in sorted order)
+void assignCanonicalCodes(const vector<pair<char, int>>& symbols, const vector<int>& lengths, map<char, string>& codes)
+{
+    vector<size_t> order(symbols.size());
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        order[i] = i;
+    }
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return lengths[a] < lengths[b]; });
+
+    string code = "";
+    for (size_t i : order)
+    {
+        code.append(lengths[i] - code.size(), '0');
+        codes[symbols[i].first] = code;
+
+        // Binary increment
+        for (size_t b = code.size(); b-- > 0; )
+        {
+            code[b] = code[b] == '0' ? '1' : '0';
+            if (code[b] == '1')
+            {
+                break;
+            }
+        }
+    }
+}
+
+// Function to calculate Huffman codes for symbols
+void calculateHuffmanCodes(const vector<pair<char, int>>& symbols, int overall_frequency, map<char, string>& codes)
+{
+    (void)overall_frequency;
+    size_t n = symbols.size();
+    if (n == 1)
+    {
+        codes[symbols[0].first] = "0"; // A lone symbol still needs one bit
+        return;
+    }
+
+    // Merge the two lightest nodes until one is left; nodes below n are symbols
+    priority_queue<pair<long long, size_t>, vector<pair<long long, size_t>>, greater<pair<long long, size_t>>> heap;
+    vector<size_t> parent(2 * n, 0);
+    for (size_t i = 0; i < n; ++i)
+    {
+        heap.push(make_pair((long long)symbols[i].second, i));
+    }
+    for (size_t node = n; heap.size() > 1; ++node)
+    {
+        pair<long long, size_t> a = heap.top(); heap.pop();
+        pair<long long, size_t> b = heap.top(); heap.pop();
+        parent[a.second] = parent[b.second] = node;
+        heap.push(make_pair(a.first + b.first, node));
+    }
+
+    // Code length = depth below the root (the last node created)
+    size_t root = 2 * n - 2;
+    vector<int> lengths(n, 0);
+    for (size_t i = 0; i < n; ++i)
+    {
+        for (size_t node = i; node != root; node = parent[node])
+        {
+            lengths[i]++;
+        }
+    }
+    assignCanonicalCodes(symbols, lengths, codes);
+}
+
+// Function to calculate optimal codes of at most max_length bits (package-merge)
+void calculateLengthLimitedCodes(const vector<pair<char, int>>& symbols, int max_length, map<char, string>& codes)
+{
+    size_t n = symbols.size();
+    if (n == 1)
+    {
+        codes[symbols[0].first] = "0"; // A lone symbol still needs one bit
+        return;
+    }
+    while ((1ULL << max_length) < n)
+    {
+        max_length++;
+    }
+
+    // Items 0..n-1 are the symbols in ascending frequency, then the packages
+    struct Item
+    {
+        long long weight;
+        size_t left, right; // Packed items (unused for symbols)
+    };
+    vector<Item> items;
+    for (size_t k = 0; k < n; ++k)
+    {
+        items.push_back(Item{symbols[n - 1 - k].second, 0, 0});
+    }
+    vector<size_t> round(n);
+    for (size_t k = 0; k < n; ++k)
+    {
+        round[k] = k;
+    }
+    for (int level = 1; level < max_length; ++level)
+    {
+        vector<size_t> merged;
+        size_t leaf = 0;
+        for (size_t k = 0; k + 1 < round.size(); k += 2)
+        {
+            items.push_back(Item{items[round[k]].weight + items[round[k + 1]].weight, round[k], round[k + 1]});
+            while (leaf < n && items[leaf].weight <= items.back().weight)
+            {
+                merged.push_back(leaf++);
+            }
+            merged.push_back(items.size() - 1);
+        }
+        while (leaf < n)
+        {
+            merged.push_back(leaf++);
+        }
+        round = merged;
+    }
+
+    // Each use of a symbol in the first 2n - 2 items adds one bit to its code
+    vector<int> lengths(n, 0);
+    vector<size_t> pending(round.begin(), round.begin() + 2 * n - 2);
+    while (!pending.empty())
+    {
+        size_t item = pending.back();
+        pending.pop_back();
+        if (item < n)
+        {
+            lengths[n - 1 - item]++;
+        }
+        else
+        {
+            pending.push_back(items[item].left);
+            pending.push_back(items[item].right);
+        }
+    }
+    assignCanonicalCodes(symbols, lengths, codes);
+}
+
+// Length-limited variants for the engine table
+void calculateLimited12Codes(const vector<pair<char, int>>& symbols, int overall_frequency, map<char, string>& codes)
+{
+    (void)overall_frequency;
+    calculateLengthLimitedCodes(symbols, 12, codes);
+}
+
+void calculateLimited15Codes(const vector<pair<char, int>>& symbols, int overall_frequency, map<char, string>& codes)
+{
+    (void)overall_frequency;
+    calculateLengthLimitedCodes(symbols, 15, codes);
+}
+
+// Code engines selectable with -e
+struct CodeEngine
+{
+    const char* name;  // Name given to -e
+    const char* label; // Printed in front of each code in the alphabet
+    void (*build)(const vector<pair<char, int>>& symbols, int overall_frequency, map<char, string>& codes);
+};
+
+static const CodeEngine code_engines[] = {
+    {"shannon", "Shannon code", calculateShannonCodes},
+    {"huffman", "Huffman code", calculateHuffmanCodes},
+    {"limited12", "Length-limited code", calculateLimited12Codes},
+    {"limited15", "Length-limited code", calculateLimited15Codes},
+};
+
+static const CodeEngine* code_engine = &code_engines[0];
+static bool report_efficiency = false; // -r
+
+// Formats the achieved bits per symbol and the entropy of the message
+string efficiency_line(const vector<pair<char, int>>& symbols, const map<char, string>& codes)
+{
+    long long total = 0, bits = 0;
+    for (const auto& symbol : symbols)
+    {
+        total += symbol.second;
+        bits += (long long)symbol.second * codes.at(symbol.first).size();
+    }
+    double entropy = 0.0;
+    for (const auto& symbol : symbols)
+    {
+        double p = (double)symbol.second / total;
+        entropy -= p * log2(p);
+    }
+    char line[96];
+    snprintf(line, sizeof(line), "Bits per symbol: %.3f, entropy: %.3f", (double)bits / total, entropy);
+    return line;
+}
+
+// Finds the engine named by -e
+const CodeEngine* find_engine(const char* name)
+{
+    for (const auto& engine : code_engines)
+    {
+        if (strcmp(engine.name, name) == 0)
+        {
+            return &engine;
+        }
+    }
+    cerr << "Unknown code engine " << name << ", choose one of:";
+    for (const auto& engine : code_engines)
+    {
+        cerr << " " << engine.name;
+    }
+    cerr << endl;
+    exit(1);
+}
+
+// Sorts the symbols of a finished frequency count and generates their codes
+void build_codes(const map<char, int>& frequency, int overall_frequency, EncodedResult& result)
+{
+    // Sort symbols by frequency and ASCII value
+    vector<pair<char, int>> sorted_symbols(frequency.begin(), frequency.end());
+    sort(sorted_symbols.begin(), sorted_symbols.end(), custom_comparator);
+    result.sorted_symbols = sorted_symbols;
+    STATS_LAP(STAGE_SORT);
+
+    // Generate codes with the selected engine
+    code_engine->build(sorted_symbols, overall_frequency, result.shannon_algorithm);
+    result.frequency = frequency;
+    STATS_LAP(STAGE_CODES);
+}
+
+// Encode kernels: codes are packed as numbers (first bit lowest) into 64-bit
+// words and expanded to '0'/'1' characters afterwards. The AVX2 and AVX-512
+// versions gather 8 or 16 codes at a time, merge neighbouring pairs and place
+// them at offsets from a prefix sum instead of appending one after another.
+struct PackedCodes
+{
+    uint32_t code[256];   // Bits of each code, first bit lowest
+    uint32_t length[256]; // Number of bits (32-bit so the vector kernels can gather it)
+    bool fits;            // All codes have at most 32 bits (otherwise strings are appended)
+};
+
+const size_t ENCODE_BLOCK = 4096;
+const size_t ENCODE_WORDS = ENCODE_BLOCK / 2 + 2;
+
+void pack_codes(const string codes[256], PackedCodes& packed)
+{
+    packed.fits = true;
+    for (int c = 0; c < 256; ++c)
+    {
+        const string& code = codes[c];
+        packed.code[c] = 0;
+        packed.length[c] = code.size();
+        if (code.size() > 32)
+        {
+            packed.fits = false;
+            continue;
+        }
+        for (size_t b = 0; b < code.size(); ++b)
+        {
+            packed.code[c] |= (uint32_t)(code[b] == '1') << b;
+        }
+    }
+}
+
+// ORs up to 64 bits into the words at a bit offset
+static inline void put_bits(uint64_t* words, size_t offset, uint64_t bits)
+{
+    size_t shift = offset & 63;
+    words[offset >> 6] |= bits << shift;
+    if (shift != 0)
+    {
+        words[(offset >> 6) + 1] |= bits >> (64 - shift);
+    }
+}
+
+// Packs n codes into zeroed words; returns the bit count
+size_t pack_scalar(const PackedCodes& packed, const unsigned char* input, size_t n, uint64_t* words)
+{
+    size_t bits = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        put_bits(words, bits, packed.code[input[i]]);
+        bits += packed.length[input[i]];
+    }
+    return bits;
+}
+
+// Writes bits [from, bits) as characters
+void expand_scalar(const uint64_t* words, size_t from, size_t bits, char* output)
+{
+    for (size_t b = from; b < bits; ++b)
+    {
+        output[b] = '0' + ((words[b >> 6] >> (b & 63)) & 1);
+    }
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("avx2")))
+size_t pack_avx2(const PackedCodes& packed, const unsigned char* input, size_t n, uint64_t* words)
+{
+    const __m256i low = _mm256_set1_epi64x(0xffffffff);
+    const __m256i zero = _mm256_setzero_si256();
+    alignas(32) uint64_t pairs[4], starts[4];
+    size_t bits = 0, i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(input + i)));
+        __m256i code = _mm256_i32gather_epi32((const int*)packed.code, index, 4);
+        __m256i length = _mm256_i32gather_epi32((const int*)packed.length, index, 4);
+
+        // Pairwise merge
+        __m256i first_length = _mm256_and_si256(length, low);
+        __m256i pair = _mm256_or_si256(_mm256_and_si256(code, low), _mm256_sllv_epi64(_mm256_srli_epi64(code, 32), first_length));
+        __m256i pair_length = _mm256_add_epi64(first_length, _mm256_srli_epi64(length, 32));
+
+        // Prefix sum of the pair lengths
+        __m256i end = pair_length;
+        end = _mm256_add_epi64(end, _mm256_blend_epi32(_mm256_permute4x64_epi64(end, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x03));
+        end = _mm256_add_epi64(end, _mm256_blend_epi32(_mm256_permute4x64_epi64(end, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x0F));
+        __m256i start = _mm256_add_epi64(_mm256_sub_epi64(end, pair_length), _mm256_set1_epi64x(bits));
+
+        _mm256_store_si256((__m256i*)pairs, pair);
+        _mm256_store_si256((__m256i*)starts, start);
+        for (int k = 0; k < 4; ++k)
+        {
+            put_bits(words, starts[k], pairs[k]);
+        }
+        bits += _mm256_extract_epi64(end, 3);
+    }
+    for (; i < n; ++i)
+    {
+        put_bits(words, bits, packed.code[input[i]]);
+        bits += packed.length[input[i]];
+    }
+    return bits;
+}
+
+__attribute__((target("avx2")))
+void expand_avx2(const uint64_t* words, size_t bits, char* output)
+{
+    // Spread 32 bits over 32 bytes and compare against each byte's bit
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i select = _mm256_set1_epi64x(0x8040201008040201LL);
+    const __m256i zeros = _mm256_set1_epi8('0');
+    size_t b = 0;
+    for (; b + 32 <= bits; b += 32)
+    {
+        uint32_t group = words[b / 64] >> (b & 63);
+        __m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32(group), spread);
+        __m256i set = _mm256_cmpeq_epi8(_mm256_and_si256(bytes, select), select);
+        _mm256_storeu_si256((__m256i*)(output + b), _mm256_sub_epi8(zeros, set));
+    }
+    expand_scalar(words, b, bits, output);
+}
+
+__attribute__((target("avx512f,bmi2")))
+size_t pack_avx512(const PackedCodes& packed, const unsigned char* input, size_t n, uint64_t* words)
+{
+    const __m512i low = _mm512_set1_epi64(0xffffffff);
+    const __m512i zero = _mm512_setzero_si512();
+    alignas(64) uint64_t pairs[8], starts[8], ends[8];
+    size_t bits = 0, i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        // Masked forms with a full mask: same result, no GCC 12 maybe-uninitialized warnings
+        __m512i index = _mm512_maskz_cvtepu8_epi32((__mmask16)-1, _mm_loadu_si128((const __m128i*)(input + i)));
+        __m512i code = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), (__mmask16)-1, index, (const int*)packed.code, 4);
+        __m512i length = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), (__mmask16)-1, index, (const int*)packed.length, 4);
+
+        // Pairwise merge
+        __m512i first_length = _mm512_and_si512(length, low);
+        __m512i pair = _mm512_or_si512(_mm512_and_si512(code, low), _mm512_maskz_sllv_epi64((__mmask8)-1, _mm512_maskz_srli_epi64((__mmask8)-1, code, 32), first_length));
+        __m512i pair_length = _mm512_add_epi64(first_length, _mm512_maskz_srli_epi64((__mmask8)-1, length, 32));
+
+        // Prefix sum of the pair lengths (lane shifts of 1, 2 and 4)
+        __m512i end = pair_length;
+        end = _mm512_add_epi64(end, _mm512_maskz_alignr_epi64((__mmask8)-1, end, zero, 7));
+        end = _mm512_add_epi64(end, _mm512_maskz_alignr_epi64((__mmask8)-1, end, zero, 6));
+        end = _mm512_add_epi64(end, _mm512_maskz_alignr_epi64((__mmask8)-1, end, zero, 4));
+        __m512i start = _mm512_add_epi64(_mm512_sub_epi64(end, pair_length), _mm512_set1_epi64(bits));
+
+        _mm512_store_si512(pairs, pair);
+        _mm512_store_si512(starts, start);
+        _mm512_store_si512(ends, end);
+        for (int k = 0; k < 8; ++k)
+        {
+            put_bits(words, starts[k], pairs[k]);
+        }
+        bits += ends[7];
+    }
+    for (; i < n; ++i)
+    {
+        put_bits(words, bits, packed.code[input[i]]);
+        bits += packed.length[input[i]];
+    }
+    return bits;
+}
+
+__attribute__((target("avx512f,bmi2")))
+void expand_avx512(const uint64_t* words, size_t bits, char* output)
+{
+    // PDEP: eight bits to eight characters
+    size_t b = 0;
+    for (; b + 8 <= bits; b += 8)
+    {
+        uint64_t chars = _pdep_u64((words[b / 64] >> (b & 63)) & 0xff, 0x0101010101010101ULL) | 0x3030303030303030ULL;
+        memcpy(output + b, &chars, 8);
+    }
+    expand_scalar(words, b, bits, output);
+}
+#endif
+
+// Picks the best supported kernels once; SHANNON_KERNEL overrides the choice
+struct EncodeKernel
+{
+    const char* name;
+    size_t (*pack)(const PackedCodes& packed, const unsigned char* input, size_t n, uint64_t* words);
+    void (*expand)(const uint64_t* words, size_t bits, char* output);
+};
+
+void expand_all_scalar(const uint64_t* words, size_t bits, char* output)
+{
+    expand_scalar(words, 0, bits, output);
+}
+
+const EncodeKernel& encode_kernel()
+{
+    static const EncodeKernel kernel = []()
+    {
+        vector<EncodeKernel> kernels;
+#if defined(__GNUC__) && defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("bmi2"))
+        {
+            kernels.push_back(EncodeKernel{"avx512", pack_avx512, expand_avx512});
+        }
+        if (__builtin_cpu_supports("avx2"))
+        {
+            kernels.push_back(EncodeKernel{"avx2", pack_avx2, expand_avx2});
+        }
+#endif
+        kernels.push_back(EncodeKernel{"scalar", pack_scalar, expand_all_scalar});
+        const char* wanted = getenv("SHANNON_KERNEL");
+        for (const auto& kernel : kernels)
+        {
+            if (wanted != nullptr && strcmp(kernel.name, wanted) == 0)
+            {
+                return kernel;
+            }
+        }
+        return kernels.front();
+    }();
+    return kernel;
+}
+
+// Appends the codes of n characters to output
+void encode_symbols(const string codes[256], const PackedCodes& packed, const char* input, size_t n, string& output)
+{
+    if (!packed.fits)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            output += codes[(unsigned char)input[i]];
+        }
+        return;
+    }
+    const EncodeKernel& kernel = encode_kernel();
+    static thread_local vector<uint64_t> words(ENCODE_WORDS);
+    for (size_t done = 0; done < n; done += ENCODE_BLOCK)
+    {
+        size_t count = min(ENCODE_BLOCK, n - done);
+        fill(words.begin(), words.begin() + count / 2 + 2, 0);
+        size_t bits = kernel.pack(packed, (const unsigned char*)input + done, count, words.data());
+        size_t old_size = output.size();
+        output.resize(old_size + bits);
+        kernel.expand(words.data(), bits, &output[old_size]);
+    }
+}
+
 // Function to perform Shannon coding on the input string
 void shannon_coding(const string& input, EncodedResult& result) 
 {
+    STATS_START();
     map<char, int> frequency;
 
     // Count frequency of each character
@@ -89,146 +678,419 @@ void shannon_coding(const string& input, EncodedResult& result)
     {
         frequency[ch]++;
     }
+    STATS_LAP(STAGE_HISTOGRAM);
 
-    // Sort symbols by frequency and ASCII value
-    vector<pair<char, int>> sorted_symbols(frequency.begin(), frequency.end());
-    sort(sorted_symbols.begin(), sorted_symbols.end(), custom_comparator);
-    result.sorted_symbols = sorted_symbols;
-
-    // Generate Shannon codes
-    int overall_frequency = input.length();
-    calculateShannonCodes(sorted_symbols, overall_frequency, result.shannon_algorithm);
+    // Sort symbols and generate Shannon codes
+    build_codes(frequency, input.length(), result);
 
     // Encode the message
-    stringstream encoded_stream;
-    for (char ch : input) 
+    string codes[256];
+    for (const auto& code : result.shannon_algorithm)
     {
-        encoded_stream << result.shannon_algorithm[ch];
+        codes[(unsigned char)code.first] = code.second;
     }
-    result.encoded_string = encoded_stream.str();
+    PackedCodes packed;
+    pack_codes(codes, packed);
+    result.encoded_string.clear();
+    encode_symbols(codes, packed, input.data(), input.size(), result.encoded_string);
     result.message = input;
-    result.frequency = frequency;
+    STATS_LAP(STAGE_ENCODE);
+    STATS_ADD(bytes_in, input.size());
+    STATS_ADD(bits_out, result.encoded_string.size());
 }
 
-// Thread function to process each message
-void* threadFunction(void* arg) 
+// Work-stealing scheduler. Each worker owns a deque of tasks: it pushes and pops
+// at the back and idle workers steal from the front. Messages longer than
+// SPLIT_SIZE are split into per-chunk histogram tasks and then per-chunk encode
+// tasks, so one huge message is spread over every core while the small ones are
+// stolen by whoever is free. Whichever sub-task finishes a phase last starts the
+// next one, so no worker ever blocks waiting for another.
+const size_t SPLIT_SIZE = 256 * 1024;
+
+// Large message whose histogram and encoding are done in SPLIT_SIZE chunks
+struct SplitJob
 {
-    ThreadData* data = (ThreadData*) arg;
+    EncodedResult* result;
+    size_t chunks;
+    vector<long long> chunk_counts; // 256 counters per chunk
+    vector<string> chunk_encoded;   // Encoded output of each chunk
+    string codes[256];              // Code of each byte value
+    PackedCodes packed;             // The same codes for the encode kernels
+    atomic<size_t> remaining;       // Sub-tasks of the current phase still running
+};
 
-    // Lock to access shared data
-    pthread_mutex_lock(&data->bsem);
+enum TaskType { TASK_MESSAGE, TASK_HISTOGRAM, TASK_ENCODE };
 
-    // Copy data to local variables
-    int local_id = data->id;
-    string local_message = data->message;
-    int total_threads = data->total_threads;
+struct Task
+{
+    TaskType type;
+    EncodedResult* result; // TASK_MESSAGE
+    SplitJob* job;         // TASK_HISTOGRAM and TASK_ENCODE
+    size_t chunk;
+};
+
+struct Worker
+{
+    pthread_mutex_t lock;  // Protects tasks
+    deque<Task> tasks;
+    pthread_t thread;
+    unsigned seed;         // For picking steal victims
+};
+
+struct Scheduler
+{
+    vector<Worker> workers;
+    pthread_mutex_t idle_lock;  // Protects done and sleeping
+    pthread_cond_t idle_cond;   // Signalled when work is pushed or everything is done
+    int sleeping;
+    bool done;
+    atomic<size_t> queued;      // Tasks sitting in any deque
+    atomic<size_t> unfinished;  // Messages not fully encoded yet
+    sem_t* print_sems;          // print_sems[i] is posted once message i is encoded
+};
+
+static Scheduler scheduler;
+
+void push_task(Worker& worker, const Task& task)
+{
+    pthread_mutex_lock(&worker.lock);
+    worker.tasks.push_back(task);
+    pthread_mutex_unlock(&worker.lock);
+    scheduler.queued++;
 
-    // Unlock after copying
-    pthread_mutex_unlock(&data->bsem);
+    // Wake a sleeping worker so it can steal the new task
+    pthread_mutex_lock(&scheduler.idle_lock);
+    if (scheduler.sleeping > 0)
+    {
+        pthread_cond_signal(&scheduler.idle_cond);
+    }
+    pthread_mutex_unlock(&scheduler.idle_lock);
+}
 
-    // Signal to main thread that data has been copied
-    sem_post(&data->copy_sem); // Let the parent know we've copied the data
+// Takes the newest task from our own deque, or failing that the oldest task of another worker
+bool take_task(size_t self, Task& task)
+{
+    Worker& worker = scheduler.workers[self];
+    pthread_mutex_lock(&worker.lock);
+    bool found = !worker.tasks.empty();
+    if (found)
+    {
+        task = worker.tasks.back();
+        worker.tasks.pop_back();
+    }
+    pthread_mutex_unlock(&worker.lock);
 
-    // Process the message
-    EncodedResult result;
-    shannon_coding(local_message, result);
+    size_t count = scheduler.workers.size();
+    size_t start = rand_r(&worker.seed) % count;
+    for (size_t i = 0; !found && i < count; ++i)
+    {
+        Worker& victim = scheduler.workers[(start + i) % count];
+        if (&victim == &worker)
+        {
+            continue;
+        }
+        pthread_mutex_lock(&victim.lock);
+        found = !victim.tasks.empty();
+        if (found)
+        {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            STATS_ADD(steals, 1);
+        }
+        pthread_mutex_unlock(&victim.lock);
+    }
+    if (found)
+    {
+        scheduler.queued--;
+    }
+    return found;
+}
 
-    // Wait for our turn to print
-    sem_wait(&data->print_sems[local_id]);
+// Lets the main thread print the message once its turn comes
+void finish_message(EncodedResult* result)
+{
+    STATS_ADD(messages, 1);
+    sem_post(&scheduler.print_sems[result->id]);
+    if (--scheduler.unfinished == 0)
+    {
+        pthread_mutex_lock(&scheduler.idle_lock);
+        scheduler.done = true;
+        pthread_cond_broadcast(&scheduler.idle_cond);
+        pthread_mutex_unlock(&scheduler.idle_lock);
+    }
+}
 
-    // Print the output
-    cout << "Message: " << result.message << endl;
-    cout << "Alphabet:" << endl;
-    for (const auto& ch_pair : result.sorted_symbols)
+void run_task(Worker& worker, const Task& task)
+{
+    STATS_START();
+    STATS_ADD(tasks, 1);
+    if (task.type == TASK_MESSAGE)
     {
-        char ch = ch_pair.first;
-        int freq = ch_pair.second;
-        cout << "Symbol: " << ch 
-             << ", Frequency: " << freq 
-             << ", Shannon code: " << result.shannon_algorithm.at(ch) << endl; 
+        EncodedResult* result = task.result;
+        size_t length = result->message.size();
+        if (length <= SPLIT_SIZE)
+        {
+            shannon_coding(result->message, *result); // Perform Shannon coding on the input string
+            finish_message(result);
+            return;
+        }
+
+        // Too big for one task: count each chunk separately
+        SplitJob* job = new SplitJob;
+        job->result = result;
+        job->chunks = (length + SPLIT_SIZE - 1) / SPLIT_SIZE;
+        job->chunk_counts.assign(job->chunks * 256, 0);
+        job->chunk_encoded.resize(job->chunks);
+        job->remaining = job->chunks;
+        for (size_t c = 0; c < job->chunks; ++c)
+        {
+            push_task(worker, Task{TASK_HISTOGRAM, nullptr, job, c});
+        }
+        STATS_ADD(bytes_in, length);
     }
-    cout << "Encoded message: " << result.encoded_string << endl << endl;
+    else if (task.type == TASK_HISTOGRAM)
+    {
+        SplitJob* job = task.job;
+        const string& input = job->result->message;
+        size_t begin = task.chunk * SPLIT_SIZE, end = min(begin + SPLIT_SIZE, input.size());
+        long long* counts = &job->chunk_counts[task.chunk * 256];
+        for (size_t i = begin; i < end; ++i)
+        {
+            counts[(unsigned char)input[i]]++;
+        }
+        STATS_LAP(STAGE_HISTOGRAM);
+        if (--job->remaining != 0)
+        {
+            return;
+        }
 
-    // Signal the next thread to print
-    if (local_id + 1 < total_threads)
+        // Last chunk counted: merge the counts, build the codes and start encoding
+        map<char, int> frequency;
+        for (int c = 0; c < 256; ++c)
+        {
+            long long total = 0;
+            for (size_t k = 0; k < job->chunks; ++k)
+            {
+                total += job->chunk_counts[k * 256 + c];
+            }
+            if (total != 0)
+            {
+                frequency[(char)c] = total;
+            }
+        }
+        vector<long long>().swap(job->chunk_counts);
+        STATS_LAP(STAGE_HISTOGRAM);
+        build_codes(frequency, input.size(), *job->result);
+        for (const auto& code : job->result->shannon_algorithm)
+        {
+            job->codes[(unsigned char)code.first] = code.second;
+        }
+        pack_codes(job->codes, job->packed);
+        job->remaining = job->chunks;
+        for (size_t c = 0; c < job->chunks; ++c)
+        {
+            push_task(worker, Task{TASK_ENCODE, nullptr, job, c});
+        }
+    }
+    else
     {
-        sem_post(&data->print_sems[local_id + 1]);
+        SplitJob* job = task.job;
+        const string& input = job->result->message;
+        size_t begin = task.chunk * SPLIT_SIZE, end = min(begin + SPLIT_SIZE, input.size());
+        string& encoded = job->chunk_encoded[task.chunk];
+        encode_symbols(job->codes, job->packed, input.data() + begin, end - begin, encoded);
+        STATS_LAP(STAGE_ENCODE);
+        if (--job->remaining != 0)
+        {
+            return;
+        }
+
+        // Last chunk encoded: join the pieces in order
+        size_t total = 0;
+        for (const auto& piece : job->chunk_encoded)
+        {
+            total += piece.size();
+        }
+        job->result->encoded_string.reserve(total);
+        for (const auto& piece : job->chunk_encoded)
+        {
+            job->result->encoded_string += piece;
+        }
+        STATS_LAP(STAGE_ENCODE);
+        STATS_ADD(bits_out, total);
+        finish_message(job->result);
+        delete job;
     }
+}
+
+// Thread function that runs tasks until every message is encoded
+void* worker_thread(void* arg) 
+{
+    size_t self = (size_t)arg;
+    Task task;
+    while (true)
+    {
+        if (take_task(self, task))
+        {
+            run_task(scheduler.workers[self], task);
+            continue;
+        }
 
-    pthread_exit(nullptr);
+        // Nothing to run or steal: sleep until more work is pushed or everything is done
+        pthread_mutex_lock(&scheduler.idle_lock);
+        while (!scheduler.done && scheduler.queued == 0)
+        {
+            scheduler.sleeping++;
+            pthread_cond_wait(&scheduler.idle_cond, &scheduler.idle_lock);
+            scheduler.sleeping--;
+        }
+        bool done = scheduler.done;
+        pthread_mutex_unlock(&scheduler.idle_lock);
+        if (done)
+        {
+            break;
+        }
+    }
+    pthread_exit(nullptr); 
 }
 
-int main() 
+int main(int argc, char* argv[]) 
 {
-    vector<string> messages;
+    vector<EncodedResult> results;
     string line;
 
+    // Parse -e (code engine) and -r (efficiency report)
+    int opt;
+    while ((opt = getopt(argc, argv, "e:r")) != -1)
+    {
+        if (opt == 'e')
+        {
+            code_engine = find_engine(optarg);
+        }
+        else if (opt == 'r')
+        {
+            report_efficiency = true;
+        }
+        else
+        {
+            cerr << "usage " << argv[0] << " [-e engine] [-r] [threads]" << endl;
+            exit(1);
+        }
+    }
+
+    // One worker per core unless a thread count is given; at most four per core
+    long cores = max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    long thread_count = cores;
+    if (argc > optind)
+    {
+        char* end;
+        errno = 0;
+        thread_count = strtol(argv[optind], &end, 10);
+        if (errno != 0 || end == argv[optind] || *end != '\0' || thread_count < 1 || thread_count > 4 * cores)
+        {
+            cerr << "Thread count must be between 1 and " << 4 * cores << endl;
+            cerr << "usage " << argv[0] << " [-e engine] [-r] [threads]" << endl;
+            exit(1);
+        }
+    }
+
+    STATS_INIT(); // Dump counters on SIGUSR1 (no-op unless built with -DSHANNON_STATS)
+
     // Read input messages from standard input
     while (getline(cin, line)) 
     {
         if (!line.empty()) 
         { 
-            messages.push_back(line);
+            EncodedResult result;
+            result.message = line;
+            result.id = results.size();
+            results.push_back(result);
         }
     }
 
-    int total_threads = messages.size();
-
-    // Initialize shared data and synchronization primitives
-    ThreadData threadData;
-    pthread_mutex_init(&threadData.bsem, nullptr);
-
-    // Initialize the semaphore for copying data
-    sem_init(&threadData.copy_sem, 0, 0);
+    int total_messages = results.size();
 
     // Initialize the semaphores for printing in order
-    threadData.total_threads = total_threads;
-    threadData.print_sems = new sem_t[total_threads];
-    for (int i = 0; i < total_threads; ++i)
+    scheduler.print_sems = new sem_t[total_messages];
+    for (int i = 0; i < total_messages; ++i)
     {
-        sem_init(&threadData.print_sems[i], 0, 0);
+        sem_init(&scheduler.print_sems[i], 0, 0);
     }
-    // Allow the first thread to print
-    sem_post(&threadData.print_sems[0]);
 
-    vector<pthread_t> threads(total_threads);
-
-    // Create and start threads
-    for (int x = 0; x < total_threads; ++x) 
+    // Deal the messages out round-robin; stealing evens out whatever is left unbalanced
+    scheduler.workers.resize(thread_count);
+    pthread_mutex_init(&scheduler.idle_lock, nullptr);
+    pthread_cond_init(&scheduler.idle_cond, nullptr);
+    scheduler.sleeping = 0;
+    scheduler.done = results.empty();
+    scheduler.queued = total_messages;
+    scheduler.unfinished = total_messages;
+    for (long w = 0; w < thread_count; ++w)
     {
-        pthread_mutex_lock(&threadData.bsem); 
-
-        threadData.id = x;                   
-        threadData.message = messages[x];    
+        pthread_mutex_init(&scheduler.workers[w].lock, nullptr);
+        scheduler.workers[w].seed = w + 1;
+    }
+    for (int i = 0; i < total_messages; ++i) 
+    {
+        scheduler.workers[i % thread_count].tasks.push_back(Task{TASK_MESSAGE, &results[i], nullptr, 0});
+    }
 
-        // Create a new thread
-        if (pthread_create(&threads[x], nullptr, threadFunction, &threadData)) 
+    // Create and start the workers
+    for (long w = 0; w < thread_count; ++w) 
+    {
+        if (pthread_create(&scheduler.workers[w].thread, nullptr, worker_thread, (void*)w)) 
         {
             cerr << "Error creating thread." << endl;
             return -1;
         }
+    }
 
-        pthread_mutex_unlock(&threadData.bsem); // Unlock after creating the thread
+    // Print the messages in input order, each as soon as it and all earlier ones are encoded
+    for (int i = 0; i < total_messages; ++i)
+    {
+        STATS_START();
+        sem_wait(&scheduler.print_sems[i]);
+        STATS_LAP(STAGE_PRINT_WAIT);
 
-        // Wait until the child thread has copied the data
-        sem_wait(&threadData.copy_sem); // Wait for child to signal data copied
+        const EncodedResult& result = results[i];
+        cout << "Message: " << result.message << endl;
+        cout << "Alphabet:" << endl;
+        for (const auto& ch_pair : result.sorted_symbols)
+        {
+            char ch = ch_pair.first;
+            int freq = ch_pair.second;
+            cout << "Symbol: " << ch 
+                 << ", Frequency: " << freq 
+                 << ", " << code_engine->label << ": " << result.shannon_algorithm.at(ch) << endl; 
+        }
+        if (report_efficiency)
+        {
+            cout << efficiency_line(result.sorted_symbols, result.shannon_algorithm) << endl;
+        }
+        cout << "Encoded message: " << result.encoded_string << endl << endl;
+        results[i] = EncodedResult(); // Printed messages are no longer needed
+        STATS_LAP(STAGE_OUTPUT);
     }
 
     // Wait for all threads to finish
-    for (int y = 0; y < total_threads; ++y) 
+    for (long w = 0; w < thread_count; ++w) 
     {
-        pthread_join(threads[y], nullptr); 
+        pthread_join(scheduler.workers[w].thread, nullptr); 
+    }
+    for (long w = 0; w < thread_count; ++w) 
+    {
+        pthread_mutex_destroy(&scheduler.workers[w].lock);
     }
 
     // Clean up and release synchronization constructs
-    pthread_mutex_destroy(&threadData.bsem);
-    sem_destroy(&threadData.copy_sem);
-
-    for (int i = 0; i < total_threads; ++i)
+    pthread_mutex_destroy(&scheduler.idle_lock);
+    pthread_cond_destroy(&scheduler.idle_cond);
+    for (int i = 0; i < total_messages; ++i)
     {
-        sem_destroy(&threadData.print_sems[i]);
+        sem_destroy(&scheduler.print_sems[i]);
     }
-    delete[] threadData.print_sems;
+    delete[] scheduler.print_sems;
+    STATS_DUMP();
 
     return 0;
 }